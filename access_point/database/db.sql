@@ -2,6 +2,9 @@ CREATE DATABASE sensor_monitoring;
 
 \c sensor_monitoring;
 
+-- Preinstalled in new databases by the timescaledb Docker image, but not by a PostgreSQL with the extension package
+CREATE EXTENSION IF NOT EXISTS timescaledb;
+
 CREATE TABLE sites (
     site_id TEXT NOT NULL,
     site_m2 INT NOT NULL,
@@ -12,15 +15,16 @@ CREATE TABLE sites (
 INSERT INTO sites(site_id, site_m2, number_of_sensors) VALUES ('apartment', 28, 6);
 
 CREATE TABLE sensors (
+    sensor_key SMALLINT GENERATED ALWAYS AS IDENTITY,  -- Compact key used in the time series tables
     sensor_id TEXT NOT NULL,
     site_id TEXT NOT NULL,
     sensor_model TEXT NOT NULL,
     location_north INT,
     location_east INT,
     ble_addr TEXT NOT NULL,
-    battery_level INT,
-    last_seen TIMESTAMPTZ,
     PRIMARY KEY (sensor_id),
+    UNIQUE (sensor_key),
+    UNIQUE (ble_addr),
     FOREIGN KEY (site_id) REFERENCES sites(site_id)
 );
 
@@ -36,11 +40,253 @@ VALUES
 
 CREATE TABLE sensor_data (
     time TIMESTAMPTZ NOT NULL,
-    sensor_id TEXT NOT NULL,
+    sensor_key SMALLINT NOT NULL,
     temperature FLOAT,
     humidity FLOAT,
-    FOREIGN KEY (sensor_id) REFERENCES sensors(sensor_id)
+    FOREIGN KEY (sensor_key) REFERENCES sensors(sensor_key)
+);
+
+SELECT create_hypertable('sensor_data', 'time', chunk_time_interval => INTERVAL '1 day');
+
+-- Per-sensor range scans are answered from this index alone on uncompressed chunks.
+CREATE INDEX sensor_data_sensor_key_time_idx ON sensor_data (sensor_key, time DESC) INCLUDE (temperature, humidity);
+
+-- Compress chunks once they no longer receive readings. Segmenting by sensor keeps each sensor's rows together,
+-- so a history query for one sensor only decompresses that sensor's segments.
+ALTER TABLE sensor_data SET (
+    timescaledb.compress,
+    timescaledb.compress_segmentby = 'sensor_key',
+    timescaledb.compress_orderby = 'time DESC'
+);
+SELECT add_compression_policy('sensor_data', INTERVAL '2 days');
+
+-- Battery level and link quality of every response, appended instead of updating the sensors table.
+CREATE TABLE sensor_status (
+    time TIMESTAMPTZ NOT NULL,
+    sensor_key SMALLINT NOT NULL,
+    battery_level SMALLINT,
+    rssi SMALLINT,
+    missed_responses SMALLINT,
+    FOREIGN KEY (sensor_key) REFERENCES sensors(sensor_key)
 );
 
-SELECT create_hypertable('sensor_data', 'time');
+SELECT create_hypertable('sensor_status', 'time', chunk_time_interval => INTERVAL '1 day');
+CREATE INDEX sensor_status_sensor_key_time_idx ON sensor_status (sensor_key, time DESC);
+
+ALTER TABLE sensor_status SET (
+    timescaledb.compress,
+    timescaledb.compress_segmentby = 'sensor_key',
+    timescaledb.compress_orderby = 'time DESC'
+);
+SELECT add_compression_policy('sensor_status', INTERVAL '2 days');
+SELECT add_retention_policy('sensor_status', INTERVAL '180 days');
+
+-- Sensor metadata with the latest battery level and last seen time. Each lookup is one index probe per sensor.
+CREATE VIEW sensors_latest AS
+SELECT
+    s.sensor_id,
+    s.site_id,
+    s.sensor_model,
+    s.location_north,
+    s.location_east,
+    s.ble_addr,
+    latest.battery_level,
+    latest.time AS last_seen
+FROM sensors s
+LEFT JOIN LATERAL (
+    SELECT time, battery_level FROM sensor_status
+    WHERE sensor_status.sensor_key = s.sensor_key
+    ORDER BY time DESC
+    LIMIT 1
+) latest ON TRUE;
+
+-- Continuous aggregates used by the web app history view. The coarsest one that still gives enough points is queried.
+-- They also form the retention tiers, see the retention policies below.
+-- materialized_only = false adds the not yet materialized raw data, so the latest readings are always included.
+CREATE MATERIALIZED VIEW sensor_data_1m
+WITH (timescaledb.continuous, timescaledb.materialized_only = false) AS
+SELECT
+    time_bucket(INTERVAL '1 minute', time) AS bucket,
+    sensor_key,
+    avg(temperature) AS temperature_avg,
+    min(temperature) AS temperature_min,
+    max(temperature) AS temperature_max,
+    avg(humidity) AS humidity_avg,
+    min(humidity) AS humidity_min,
+    max(humidity) AS humidity_max
+FROM sensor_data
+GROUP BY bucket, sensor_key
+WITH NO DATA;
+
+CREATE MATERIALIZED VIEW sensor_data_5m
+WITH (timescaledb.continuous, timescaledb.materialized_only = false) AS
+SELECT
+    time_bucket(INTERVAL '5 minutes', time) AS bucket,
+    sensor_key,
+    avg(temperature) AS temperature_avg,
+    min(temperature) AS temperature_min,
+    max(temperature) AS temperature_max,
+    avg(humidity) AS humidity_avg,
+    min(humidity) AS humidity_min,
+    max(humidity) AS humidity_max
+FROM sensor_data
+GROUP BY bucket, sensor_key
+WITH NO DATA;
+
+CREATE MATERIALIZED VIEW sensor_data_15m
+WITH (timescaledb.continuous, timescaledb.materialized_only = false) AS
+SELECT
+    time_bucket(INTERVAL '15 minutes', time) AS bucket,
+    sensor_key,
+    avg(temperature) AS temperature_avg,
+    min(temperature) AS temperature_min,
+    max(temperature) AS temperature_max,
+    avg(humidity) AS humidity_avg,
+    min(humidity) AS humidity_min,
+    max(humidity) AS humidity_max
+FROM sensor_data
+GROUP BY bucket, sensor_key
+WITH NO DATA;
+
+CREATE MATERIALIZED VIEW sensor_data_1h
+WITH (timescaledb.continuous, timescaledb.materialized_only = false) AS
+SELECT
+    time_bucket(INTERVAL '1 hour', time) AS bucket,
+    sensor_key,
+    avg(temperature) AS temperature_avg,
+    min(temperature) AS temperature_min,
+    max(temperature) AS temperature_max,
+    avg(humidity) AS humidity_avg,
+    min(humidity) AS humidity_min,
+    max(humidity) AS humidity_max
+FROM sensor_data
+GROUP BY bucket, sensor_key
+WITH NO DATA;
+
+SELECT add_continuous_aggregate_policy('sensor_data_1m',
+    start_offset => INTERVAL '1 hour', end_offset => INTERVAL '1 minute', schedule_interval => INTERVAL '1 minute');
+SELECT add_continuous_aggregate_policy('sensor_data_5m',
+    start_offset => INTERVAL '1 day', end_offset => INTERVAL '5 minutes', schedule_interval => INTERVAL '5 minutes');
+SELECT add_continuous_aggregate_policy('sensor_data_15m',
+    start_offset => INTERVAL '1 day', end_offset => INTERVAL '15 minutes', schedule_interval => INTERVAL '15 minutes');
+SELECT add_continuous_aggregate_policy('sensor_data_1h',
+    start_offset => INTERVAL '3 days', end_offset => INTERVAL '1 hour', schedule_interval => INTERVAL '1 hour');
+
+-- Tiered retention: raw readings and 1-minute buckets for 30 days, 5- and 15-minute buckets for a year, hourly buckets
+-- indefinitely. The refresh windows above stay well inside the raw retention, so dropping raw chunks never empties
+-- an aggregate. The web app routes queries by the same limits (SENSOR_DATA_RAW_RETENTION_H, SENSOR_DATA_AGGREGATES).
 SELECT add_retention_policy('sensor_data', INTERVAL '30 days');
+SELECT add_retention_policy('sensor_data_1m', INTERVAL '30 days');
+SELECT add_retention_policy('sensor_data_5m', INTERVAL '365 days');
+SELECT add_retention_policy('sensor_data_15m', INTERVAL '365 days');
+
+
+-- Neighbour-based drift detection. Sensors of one site should agree with the interpolation of their nearest neighbours
+-- within a band. A sensor whose offset from its neighbours changes over days is drifting. Runs daily on the hourly
+-- aggregate, so its cost grows with the number of sensors and not with the number of readings.
+CREATE TABLE sensor_neighbours (
+    sensor_key SMALLINT NOT NULL,
+    neighbour_key SMALLINT NOT NULL,
+    weight FLOAT NOT NULL,  -- Inverse distance squared
+    PRIMARY KEY (sensor_key, neighbour_key),
+    FOREIGN KEY (sensor_key) REFERENCES sensors(sensor_key),
+    FOREIGN KEY (neighbour_key) REFERENCES sensors(sensor_key)
+);
+
+-- One row per sensor and UTC day. The residual is the daily mean of the sensor minus its neighbours' interpolated value,
+-- the drift is the mean residual of the recent days minus that of the baseline days before them.
+CREATE TABLE sensor_drift (
+    day DATE NOT NULL,
+    sensor_key SMALLINT NOT NULL,
+    hours SMALLINT NOT NULL,  -- Hourly buckets with both the sensor and its neighbours
+    temperature_residual FLOAT NOT NULL,
+    humidity_residual FLOAT NOT NULL,
+    temperature_drift FLOAT,  -- NULL until the baseline has enough days
+    humidity_drift FLOAT,
+    drifting BOOLEAN,
+    PRIMARY KEY (sensor_key, day),
+    FOREIGN KEY (sensor_key) REFERENCES sensors(sensor_key)
+);
+
+CREATE OR REPLACE PROCEDURE detect_sensor_drift(job_id INT, config JSONB)
+LANGUAGE plpgsql AS $$
+DECLARE
+    neighbour_count INT := coalesce((config->>'neighbours')::INT, 4);
+    recent_days INT := coalesce((config->>'recent_days')::INT, 3);
+    baseline_days INT := coalesce((config->>'baseline_days')::INT, 30);
+    temperature_band FLOAT := coalesce((config->>'temperature_band')::FLOAT, 0.5);
+    humidity_band FLOAT := coalesce((config->>'humidity_band')::FLOAT, 3.0);
+    last_day DATE := (now() AT TIME ZONE 'UTC')::DATE - 1;  -- Last complete day
+    first_day DATE;
+BEGIN
+    -- Neighbour sets: the nearest located sensors of the same site. Rebuilt on every run, so moved or added sensors
+    -- are picked up. Sensors at the same spot are treated as half a unit apart.
+    DELETE FROM sensor_neighbours;
+    INSERT INTO sensor_neighbours (sensor_key, neighbour_key, weight)
+    SELECT sensor_key, neighbour_key, 1.0 / greatest(distance_sq, 0.25)
+    FROM (
+        SELECT s.sensor_key, n.sensor_key AS neighbour_key, distance.sq AS distance_sq,
+               row_number() OVER (PARTITION BY s.sensor_key ORDER BY distance.sq, n.sensor_key) AS rank
+        FROM sensors s
+        JOIN sensors n ON n.site_id = s.site_id AND n.sensor_key <> s.sensor_key
+        CROSS JOIN LATERAL (
+            SELECT (s.location_north - n.location_north)^2 + (s.location_east - n.location_east)^2 AS sq
+        ) distance
+        WHERE distance.sq IS NOT NULL
+    ) ranked
+    WHERE rank <= neighbour_count;
+
+    -- Only the days since the last run are computed. The first run fills the baseline too.
+    SELECT coalesce(max(day) + 1, last_day - recent_days - baseline_days) INTO first_day FROM sensor_drift;
+    IF first_day > last_day THEN
+        RETURN;
+    END IF;
+
+    WITH hourly AS MATERIALIZED (
+        SELECT bucket, sensor_key, temperature_avg, humidity_avg FROM sensor_data_1h
+        WHERE bucket >= first_day::TIMESTAMP AT TIME ZONE 'UTC' AND bucket < (last_day + 1)::TIMESTAMP AT TIME ZONE 'UTC'
+          AND temperature_avg IS NOT NULL AND humidity_avg IS NOT NULL
+    ), expected AS (
+        SELECT h.bucket, nb.sensor_key,
+               sum(nb.weight * h.temperature_avg) / sum(nb.weight) AS temperature,
+               sum(nb.weight * h.humidity_avg) / sum(nb.weight) AS humidity
+        FROM hourly h JOIN sensor_neighbours nb ON nb.neighbour_key = h.sensor_key
+        GROUP BY h.bucket, nb.sensor_key
+    )
+    INSERT INTO sensor_drift (day, sensor_key, hours, temperature_residual, humidity_residual)
+    SELECT (h.bucket AT TIME ZONE 'UTC')::DATE, h.sensor_key, count(*),
+           avg(h.temperature_avg - e.temperature), avg(h.humidity_avg - e.humidity)
+    FROM hourly h JOIN expected e USING (bucket, sensor_key)
+    GROUP BY 1, h.sensor_key
+    ON CONFLICT (sensor_key, day) DO NOTHING;
+
+    -- Compare the recent residual of every new day with the baseline before it
+    UPDATE sensor_drift d
+    SET temperature_drift = w.recent_temperature - w.baseline_temperature,
+        humidity_drift = w.recent_humidity - w.baseline_humidity,
+        drifting = abs(w.recent_temperature - w.baseline_temperature) > temperature_band
+                   OR abs(w.recent_humidity - w.baseline_humidity) > humidity_band
+    FROM (
+        SELECT day, sensor_key,
+               avg(temperature_residual) OVER recent AS recent_temperature,
+               avg(humidity_residual) OVER recent AS recent_humidity,
+               avg(temperature_residual) OVER baseline AS baseline_temperature,
+               avg(humidity_residual) OVER baseline AS baseline_humidity,
+               count(*) OVER baseline AS baseline_count
+        FROM sensor_drift
+        WHERE day >= first_day - recent_days - baseline_days
+        WINDOW recent AS (PARTITION BY sensor_key ORDER BY day
+                          RANGE BETWEEN make_interval(days => recent_days - 1) PRECEDING AND CURRENT ROW),
+               baseline AS (PARTITION BY sensor_key ORDER BY day
+                            RANGE BETWEEN make_interval(days => recent_days + baseline_days - 1) PRECEDING
+                                      AND make_interval(days => recent_days) PRECEDING)
+    ) w
+    WHERE d.day = w.day AND d.sensor_key = w.sensor_key AND d.day >= first_day
+      AND w.baseline_count >= baseline_days / 2;
+END
+$$;
+
+-- Runs daily at 02:00 UTC, after the hourly aggregate has been refreshed past midnight
+SELECT add_job('detect_sensor_drift', INTERVAL '1 day',
+    config => '{"neighbours": 4, "recent_days": 3, "baseline_days": 30, "temperature_band": 0.5, "humidity_band": 3.0}',
+    initial_start => date_trunc('day', now(), 'UTC') + INTERVAL '1 day 2 hours');
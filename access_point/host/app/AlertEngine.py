@@ -0,0 +1,231 @@
+"""
+Filename: AlertEngine.py
+Author: Markus Andersson
+Date: January 11, 2025
+
+Description:
+Classes for evaluating alert rules and detecting anomalies on every reading in the ingest path.
+
+License: MIT License
+
+License:
+This file is part of an open-source project and is distributed under the terms
+of the MIT License. You may obtain a copy of the License at:
+https://opensource.org/licenses/MIT
+
+Copyright (c) 2025, Markus Andersson. All rights reserved.
+"""
+
+import datetime
+import json
+import logging
+import math
+
+ALERT_FIRING = "firing"
+ALERT_RESOLVED = "resolved"
+
+
+class ThresholdRule():
+    """ Fires when a field of the reading is below low or above high. It resolves once the value is back inside the
+    limits by at least the hysteresis, so a value hovering at a limit does not flap. The hysteresis does the job of
+    the debounce, so by default the rule fires on the first reading outside the limits instead of one read period
+    later. """
+    def __init__(self, name, field, low=None, high=None, hysteresis=0.0, debounce=1):
+        self.name = name
+        self.field = field
+        self.low = low
+        self.high = high
+        self.hysteresis = hysteresis
+        self.debounce = debounce  # None uses the debounce of the engine
+
+    def check(self, state, reading):
+        """ Returns (violated, value), or None if the reading has no value for the field. """
+        value = reading.get(self.field)
+        if value == None:
+            return None
+        margin = self.hysteresis if state.active else 0.0
+        violated = (self.low != None and value < self.low + margin) or (self.high != None and value > self.high - margin)
+        return violated, value
+
+
+class RateOfChangeRule():
+    """ Fires when a field changes faster than max_change per per_s seconds, measured against a reading at least
+    window_s old. Between consecutive readings the jitter of the sensor alone would exceed any useful rate, so the
+    change is taken over the window, and must also be at least min_change. The state is two readings: the reference,
+    and the candidate that replaces it once it is window_s old, so the reference is between one and two windows old. """
+    def __init__(self, name, field, max_change, per_s=60, window_s=600, min_change=0.0, debounce=None):
+        self.name = name
+        self.field = field
+        self.max_change = max_change
+        self.per_s = per_s
+        self.window_s = window_s
+        self.min_change = min_change
+        self.debounce = debounce
+
+    def check(self, state, reading):
+        value = reading.get(self.field)
+        if value == None or self.max_change == None:
+            return None
+        timestamp = reading["timestamp"]
+        if state.previous == None:
+            state.previous = (value, timestamp, value, timestamp)  # Reference and candidate (value, timestamp)
+            return None
+        reference_value, reference_time, candidate_value, candidate_time = state.previous
+        if (timestamp - candidate_time).total_seconds() >= self.window_s:
+            reference_value, reference_time = candidate_value, candidate_time
+            state.previous = (reference_value, reference_time, value, timestamp)
+        elapsed_s = (timestamp - reference_time).total_seconds()
+        if elapsed_s < self.window_s:
+            return None
+        change = value - reference_value
+        rate = change * self.per_s / elapsed_s
+        return abs(rate) > self.max_change and abs(change) >= self.min_change, round(rate, 2)
+
+
+class OutlierRule():
+    """ Fires on readings that are more than threshold standard deviations from the exponentially weighted moving
+    average of the tag. The mean and variance are updated with every reading, clamped to the threshold, so an outlier
+    does not drag the baseline towards itself. No readings are flagged until warmup readings have been seen. """
+    def __init__(self, name, field, threshold=4.0, alpha=0.05, warmup=20, min_std=0.05, debounce=1):
+        self.name = name
+        self.field = field
+        self.threshold = threshold
+        self.alpha = alpha
+        self.warmup = warmup
+        self.min_std = min_std  # Floor for the deviation, so a flat signal does not turn its resolution into outliers
+        self.debounce = debounce
+
+    def check(self, state, reading):
+        value = reading.get(self.field)
+        if value == None:
+            return None
+        if state.previous == None:
+            state.previous = (value, 0.0, 1)  # Mean, variance, readings seen
+            return None
+
+        mean, variance, seen = state.previous
+        std = max(math.sqrt(variance), self.min_std)
+        z = (value - mean) / std
+        clamped = mean + max(-self.threshold, min(self.threshold, z)) * std
+        difference = clamped - mean
+        increment = self.alpha * difference
+        state.previous = (mean + increment, (1 - self.alpha) * (variance + difference * increment), seen + 1)
+        if seen < self.warmup:
+            return None
+        return abs(z) > self.threshold, round(z, 2)
+
+
+class StuckRule():
+    """ Fires when a tag has reported exactly the same value for stuck_after_s, which a working sensor never does.
+    The time restarts after a gap of more than max_gap_s between two readings, so a tag that was offline, e.g. for the
+    stale limit, is not called stuck because it came back with the value it left with. """
+    def __init__(self, name, field, stuck_after_s, max_gap_s=None, debounce=1):
+        self.name = name
+        self.field = field
+        self.stuck_after_s = stuck_after_s
+        self.max_gap_s = max_gap_s
+        self.debounce = debounce
+
+    def check(self, state, reading):
+        value = reading.get(self.field)
+        if value == None:
+            return None
+        timestamp = reading["timestamp"]
+        if (state.previous == None or state.previous[0] != value or
+                (self.max_gap_s != None and (timestamp - state.previous[2]).total_seconds() > self.max_gap_s)):
+            state.previous = (value, timestamp, timestamp)  # Value, the time it was first seen and the latest reading
+        else:
+            state.previous = (value, state.previous[1], timestamp)
+        return (timestamp - state.previous[1]).total_seconds() >= self.stuck_after_s, value
+
+
+class RuleState():
+    """ Per sensor state of one rule. """
+    __slots__ = ("active", "count", "previous")
+
+    def __init__(self):
+        self.active = False
+        self.count = 0  # Consecutive readings that disagree with the active flag
+        self.previous = None  # Fixed-size state of the rule, e.g. the last (value, timestamp)
+
+
+class AlertEngine():
+    """ Evaluates the rules of a site on every reading, before it is published.
+
+    Every sensor has a fixed amount of state per rule, so a reading costs O(rules). A rule fires after it has been
+    violated by debounce consecutive readings, unless the rule sets its own, and resolves after as many readings
+    without a violation. Only the changes are emitted. A sensor is stale when it has not sent a reading for
+    stale_after_s, which check_stale() evaluates from the time of the last reading, without asking the database.
+    """
+    def __init__(self, site_id, rules, sensor_rules=None, debounce=2, stale_after_s=None):
+        self.logger = logging.getLogger(__name__)
+        self.site_id = site_id
+        self.rules = rules
+        self.sensor_rules = sensor_rules or {}  # Lower case BLE address -> rules that replace the site rules of the same name
+        self.debounce = debounce
+        self.stale_after_s = stale_after_s
+        self.states = {}  # (BLE address, rule name) -> RuleState
+        self.last_seen = {}  # BLE address -> timestamp of the latest reading
+        self.stale = set()  # BLE addresses that have fired a stale alert
+
+    def get_rules(self, address):
+        overrides = self.sensor_rules.get(address)
+        if not overrides:
+            return self.rules
+        names = {rule.name for rule in overrides}
+        return [rule for rule in self.rules if rule.name not in names] + overrides
+
+    def process(self, reading):
+        """ Evaluate the rules on a reading. Returns the alerts that fired or resolved. """
+        address = reading["address"].lower()
+        alerts = []
+        self.last_seen[address] = reading["timestamp"]
+        if address in self.stale:
+            self.stale.discard(address)
+            alerts.append(self.make_alert(address, "stale", ALERT_RESOLVED, None, reading["timestamp"]))
+
+        for rule in self.get_rules(address):
+            state = self.states.get((address, rule.name))
+            if state == None:
+                state = RuleState()
+                self.states[(address, rule.name)] = state
+            result = rule.check(state, reading)
+            if result == None:
+                continue
+            violated, value = result
+            if violated == state.active:
+                state.count = 0
+                continue
+            state.count += 1
+            if state.count >= (rule.debounce or self.debounce):
+                state.active = violated
+                state.count = 0
+                alerts.append(self.make_alert(address, rule.name, ALERT_FIRING if violated else ALERT_RESOLVED,
+                                              value, reading["timestamp"]))
+        return alerts
+
+    def check_stale(self, now):
+        """ Fire a stale alert for every sensor whose latest reading is older than stale_after_s. """
+        if self.stale_after_s == None:
+            return []
+        alerts = []
+        for address, last_seen in self.last_seen.items():
+            if address not in self.stale and (now - last_seen).total_seconds() > self.stale_after_s:
+                self.stale.add(address)
+                alerts.append(self.make_alert(address, "stale", ALERT_FIRING, last_seen.isoformat(), now))
+        return alerts
+
+    def make_alert(self, address, rule, state, value, timestamp):
+        self.logger.warning(f"Alert {rule} {state} for sensor tag {address}: {value}")
+        return {
+            "site_id": self.site_id,
+            "address": address.upper(),
+            "rule": rule,
+            "state": state,
+            "value": value,
+            "timestamp": timestamp.isoformat(),
+        }
+
+
+def encode_alert(alert):
+    return json.dumps(alert)
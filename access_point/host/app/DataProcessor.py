@@ -4,7 +4,7 @@ Author: Markus Andersson
 Date: January 11, 2025
 
 Description:
-Class for parsing and publishing (MQTT) the data received by the access point.
+Class for parsing, checking for alerts, and publishing (MQTT) the data received by the access point.
 
 License: MIT License
 
@@ -17,6 +17,8 @@ Copyright (c) 2025, Markus Andersson. All rights reserved.
 """
 
 from utils.ble import *
+from wsn_telemetry import *
+from AlertEngine import encode_alert
 import threading
 import paho.mqtt.client as mqtt
 import time
@@ -28,7 +30,9 @@ import logging
 PUBLISH_TO_MQTT = True
 
 class DataProcessor(threading.Thread):
-    def __init__(self, queue, mqtt_host, mqtt_port, mqtt_topic, args=(), kwargs=None):
+    def __init__(self, queue, mqtt_host, mqtt_port, mqtt_topic, mqtt_encoding=TELEMETRY_ENCODING_JSON,
+                 batch_size=1, batch_timeout_s=1.0, alert_engine=None, alert_topic=None, alert_check_period_s=30,
+                 args=(), kwargs=None):
         self.logger = logging.getLogger(__name__)
         threading.Thread.__init__(self, args=(), kwargs=None)
         self.queue = queue
@@ -37,21 +41,41 @@ class DataProcessor(threading.Thread):
         self.host = mqtt_host
         self.port = mqtt_port
         self.topic = mqtt_topic
+        self.encoding = mqtt_encoding
+        self.batch_size = batch_size
+        self.batch_timeout_s = batch_timeout_s
+        self.batch = []
+        self.batch_deadline = None  # Monotonic time by which the oldest pending reading has to be published
         self.client = None
+        self.alert_engine = alert_engine
+        self.alert_topic = alert_topic
+        self.alert_check_period_s = alert_check_period_s
+        self.next_alert_check = time.monotonic() + alert_check_period_s
 
         self.init_mqtt()
 
     def run(self):
         while 1:
-            # Check if there is any data in the queue
+            # Flush the pending batch once its oldest reading has waited batch_timeout_s, even if readings keep arriving.
+            # Otherwise wait for more data, but not past that deadline.
+            if self.batch and time.monotonic() >= self.batch_deadline:
+                self.flush_batch()
+            timeout = max(0.0, self.batch_deadline - time.monotonic()) if self.batch else None
+            if self.alert_engine != None:
+                self.check_stale_sensors()
+                until_check = max(0.0, self.next_alert_check - time.monotonic())
+                timeout = until_check if timeout == None else min(timeout, until_check)
             try:
-                adv_info = self.queue.get()
+                adv_info = self.queue.get(timeout=timeout)
             except queue.Empty:
                 continue
             
             # Deconstruct the advertisement data into chunks of characteristic data
             adv_data = adv_info[0]
-            adv_address = adv_info[1].upper()
+            adv_address = adv_info[1]
+            timestamp = adv_info[2]  # UTC time of the response, derived from the PAwR event counter
+            rssi = adv_info[3]
+            missed_responses = adv_info[4]
             temperature = get_from_adv_data(adv_data, BLE_ADV_TYPE_CHAR, BLE_TEMP_CHAR_UUID)
             humidity = get_from_adv_data(adv_data, BLE_ADV_TYPE_CHAR, BLE_HUM_CHAR_UUID)
             battery_level = int.from_bytes(get_from_adv_data(adv_data, BLE_ADV_TYPE_CHAR, BLE_BATTERY_LEVEL_CHAR_UUID), "big")
@@ -59,25 +83,56 @@ class DataProcessor(threading.Thread):
             # Parse the characteristic data into the required datatype
             temperature = parse_char_data(temperature, float)
             humidity = parse_char_data(humidity, float)
-            timestamp = datetime.datetime.now().strftime("%Y-%m-%dT%H:%M:%S.%f")
 
-            mqtt_data = {
+            reading = {
                 "address": adv_address,
                 "timestamp": timestamp,
                 "temperature": temperature,
                 "humidity": humidity,
                 "battery_level": battery_level,
+                "rssi": rssi,
+                "missed_responses": missed_responses,
             }
 
+            # Alerts are sent right away, not batched with the readings
+            if self.alert_engine != None:
+                for alert in self.alert_engine.process(reading):
+                    self.publish_alert(alert)
+
             if PUBLISH_TO_MQTT == True:
-                self.publish_mqtt_data(mqtt_data)
+                if self.encoding == TELEMETRY_ENCODING_PACKED:
+                    if not self.batch:
+                        self.batch_deadline = time.monotonic() + self.batch_timeout_s
+                    self.batch.append(reading)
+                    if len(self.batch) >= self.batch_size:
+                        self.flush_batch()
+                else:
+                    reading["address"] = adv_address.upper()
+                    self.publish_mqtt_data(encode_json(reading), reading)
 
     def init_mqtt(self):
         self.client = mqtt.Client()
         self.client.connect(self.host, self.port, keepalive=300)
+        self.client.loop_start()  # Network thread: sends the QoS 1 alerts and their acknowledgements, keepalive and reconnects
         self.logger.info(f"Dataprocessor connected to {self.host}:{self.port}")
 
-    def publish_mqtt_data(self, mqtt_data):
-        self.client.publish(self.topic, json.dumps(mqtt_data))
-        self.logger.info(f"Published data to {self.host}:{self.port}: {mqtt_data}")
-    
+    def publish_mqtt_data(self, payload, log_data):
+        self.client.publish(self.topic, payload)
+        self.logger.info(f"Published data to {self.host}:{self.port}: {log_data}")
+
+    def publish_alert(self, alert):
+        self.client.publish(self.alert_topic, encode_alert(alert), qos=1)
+
+    def check_stale_sensors(self):
+        """ Alert on sensors that have stopped sending readings. Runs every alert_check_period_s. """
+        if time.monotonic() < self.next_alert_check:
+            return
+        self.next_alert_check = time.monotonic() + self.alert_check_period_s
+        for alert in self.alert_engine.check_stale(datetime.datetime.now(datetime.timezone.utc)):
+            self.publish_alert(alert)
+
+    def flush_batch(self):
+        """ Publish all pending readings as one packed message. """
+        if self.batch:
+            self.publish_mqtt_data(encode_packed(self.batch), f"{len(self.batch)} packed readings")
+            self.batch = []
@@ -22,6 +22,7 @@ import json
 import logging
 import threading
 from utils.timescale import *
+from wsn_telemetry import decode
 from queue import Queue
 from config import * 
 import traceback
@@ -38,6 +39,7 @@ class DatabaseClient():
         self.connected = False
         self.ready_to_loop = False
         self.topic_queue = Queue()
+        self.sensor_keys = {}  # BLE address -> sensor_key, filled on demand
         
         self.client = mqtt.Client()
         self.client.on_connect = self.on_connect
@@ -72,29 +74,40 @@ class DatabaseClient():
         self.write_sensor_data_to_db(message)
 
     def write_sensor_data_to_db(self, mqtt_message):
-        """ Unpack the MQTT message, construct the SQL-query, and write the data to database"""
-        sensor_data = json.loads(mqtt_message.payload.decode("utf-8"))
-        address = sensor_data.get("address").lower()
-        timestamp = sensor_data.get("timestamp")
-        temperature = sensor_data.get("temperature")
-        humidity = sensor_data.get("humidity")
-        battery_level = sensor_data.get("battery_level")
-
-        sensor_id_query = f"SELECT sensor_id FROM sensors WHERE ble_addr = '{address}';" 
+        """ Unpack the MQTT message (JSON or packed batch), and write all of its readings to database in one transaction. """
+        try:
+            readings = decode(mqtt_message.payload)
+        except Exception as e:
+            self.logger.error(f"Failed to decode message on topic {mqtt_message.topic}: {e}")
+            return
+
+        unknown_addresses = list({reading["address"] for reading in readings} - self.sensor_keys.keys())
+        sensor_key_query = "SELECT ble_addr, sensor_key FROM sensors WHERE ble_addr = ANY(%s);"
         try:
             with psycopg2.connect(TIMESCALE_CONNECTION) as conn:
                 self.logger.debug(f"Connected to database at {TIMESCALE_HOST}:{TIMESCALE_PORT}")
                 cursor = conn.cursor()
-                sensor_id = timescale_read(cursor, sensor_id_query)[0][0]  # Get the sensor id corresponding to the BLE addr
-            
-                # Update the sensors battery level and last seen values
-                sensor_bat_and_last_seen_query = f"UPDATE sensors SET battery_level = {battery_level}, last_seen = '{timestamp}' WHERE sensor_id = '{sensor_id}'"
-                timescale_write(cursor, sensor_bat_and_last_seen_query)
+                if unknown_addresses:
+                    self.sensor_keys.update(timescale_read(cursor, sensor_key_query, (unknown_addresses,)))  # Map the BLE addrs to sensor keys
+
+                sensor_data_rows = []
+                sensor_status_rows = []
+                for reading in readings:
+                    sensor_key = self.sensor_keys.get(reading["address"])
+                    if sensor_key == None:
+                        self.logger.error(f"No sensor registered with BLE address {reading['address']}. Dropping reading.")
+                        continue
+                    sensor_data_rows.append((reading["timestamp"], sensor_key, reading["temperature"], reading["humidity"]))
+                    sensor_status_rows.append((reading["timestamp"], sensor_key, reading["battery_level"], reading["rssi"], reading["missed_responses"]))
                 
                 # Add the sensor data to the sensor_data table
-                sensor_data_query = f"INSERT INTO sensor_data (time, sensor_id, temperature, humidity) values ('{timestamp}', '{sensor_id}', {temperature}, {humidity});"
-                timescale_write(cursor, sensor_data_query)
-                self.logger.info(f"Data written to database: {sensor_data}")
+                sensor_data_query = "INSERT INTO sensor_data (time, sensor_key, temperature, humidity) values (%s, %s, %s, %s);"
+                timescale_write_many(cursor, sensor_data_query, sensor_data_rows)
+
+                # Append the battery level and link quality. The latest values are read through the sensors_latest view.
+                sensor_status_query = "INSERT INTO sensor_status (time, sensor_key, battery_level, rssi, missed_responses) values (%s, %s, %s, %s, %s);"
+                timescale_write_many(cursor, sensor_status_query, sensor_status_rows)
+                self.logger.info(f"{len(sensor_data_rows)} readings written to database from topic {mqtt_message.topic}")
                 
         except Exception as e:
             tb_str = traceback.format_exc()
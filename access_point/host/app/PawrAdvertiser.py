@@ -18,11 +18,12 @@ Copyright (c) 2025, Markus Andersson. All rights reserved.
 
 import logging
 from common.util import BluetoothApp
-import threading
 import time
 from utils.ble import *
 from config import *
 from SensorTag import SensorTag
+from TagRegistry import TagRegistry
+from PawrClock import PawrClock
 
 # -------------------- Connection parameters -------------------- #
 CONNECTION_PHY = 1
@@ -34,6 +35,11 @@ PAWR_SENSOR_READ_PERIOD_S = PAWR_SENSOR_READ_PERIOD_M * 60
 PAWR_HEADER_SIZE = 2
 PAWR_BROADCAST_ADDRESS = 255
 PAWR_MAX_ALLOWED_MISSED_RESPONSES = 2
+PAWR_OUT_OF_SYNC_LIMIT = 20  # PAwR intervals without a subevent before a tag drops the sync and advertises, see sensor_tag/app.c
+PAWR_OUT_OF_SYNC_MARGIN = 1.5
+PAWR_HOUSEKEEPING_PERIOD_S = 5 * 60
+PAWR_COMPACTION_PERIOD_S = 60
+PAWR_WALL_CLOCK_CHECK_PERIOD_S = 60
 
 PAWR_ADVERTISING_SET = 0
 PAWR_FLAGS = 0x2
@@ -44,6 +50,9 @@ PAWR_RESPONSE_SLOTS = 23
 PAWR_RESPONSE_SLOT_DELAY = 34  # 42.5ms. 15 * 1.25ms seems to be minimum
 PAWR_RESPONSE_SLOT_SPACING = 12
 
+PAWR_INTERVAL_UNIT_NS = 1_250_000  # Unit of the interval, subevent interval and response slot delay
+PAWR_RESPONSE_SLOT_SPACING_UNIT_NS = 125_000
+
 
 # -------------------- Main class -------------------- #
 class PawrAdvertiser(BluetoothApp):
@@ -51,15 +60,16 @@ class PawrAdvertiser(BluetoothApp):
         super().__init__(connector)
         self.logger = logging.getLogger(__name__)
         self.pawr_advertising_set_handle = None     
-        self.advertising_tags = []
-        self.subevent_count = 0
-        self.response_slot_count = 0
+        self.advertising_tags = set()
         self.connection_info = None
         self.data_processing_thread = data_processing_thread
-        self.tags = [[]]
-        self.tag_waiting_list = []  # Tags that we are expecting a response from 
+        self.pipeline = data_processing_thread.queue
+        self.tags = TagRegistry(PAWR_SUBEVENTS, PAWR_RESPONSE_SLOTS)
         self.read_sensor_values = False
-        self.synced_tags = 0
+        self.compact_response_slots = False
+        self.clock = PawrClock(PAWR_INTERVAL * PAWR_INTERVAL_UNIT_NS)
+        self.timers = []
+        self.release_timers = {}  # BLE address -> timer that frees the slot of a tag that dropped from sync
 
     def bt_evt_system_boot(self, evt):
         """ Immediately start the scanner and PAwR train. """
@@ -80,29 +90,51 @@ class PawrAdvertiser(BluetoothApp):
             self.lib.bt.scanner.SCAN_PHY_SCAN_PHY_1M,
             self.lib.bt.scanner.DISCOVER_MODE_DISCOVER_OBSERVATION)
         self.logger.info("Scanning started.")
-        self.scanner_sensor_read_timer = threading.Thread(target=self.sensor_data_period_handler)  # TODO: Improve naming of this thread
-        self.scanner_sensor_read_timer.start()
+
+        # The PAwR train has restarted, so the event counter no longer matches the old anchor
+        self.clock.reset()
+        self.clock.check_wall_clock()
+
+        # Drive the read cycles and housekeeping from the event loop. Cancel the timers of a previous boot first.
+        for timer in self.timers:
+            timer.cancel()
+        self.logger.info(f"Sensor reading period is set to {PAWR_SENSOR_READ_PERIOD_M} minutes.") 
+        self.timers = [
+            self.scheduler.call_every(PAWR_SENSOR_READ_PERIOD_S, self.start_read_cycle),
+            self.scheduler.call_every(PAWR_HOUSEKEEPING_PERIOD_S, self.housekeeping),
+            self.scheduler.call_every(PAWR_COMPACTION_PERIOD_S, self.start_compaction),
+            self.scheduler.call_every(PAWR_WALL_CLOCK_CHECK_PERIOD_S, self.clock.check_wall_clock),
+        ]
     
     def bt_evt_scanner_legacy_advertisement_report(self, evt):
         """ Check if device is of wanted type, and open connection if true. Currently only supporting one connection at a time. """
         if self.connection_info == None:
             if self.is_sensor(evt.data) and evt.address not in self.advertising_tags:
                 self.lib.bt.scanner.stop()
-                self.advertising_tags.append(evt.address)
+                self.advertising_tags.add(evt.address)
                 self.logger.info(f"Sensor Peripheral found with address {evt.address}. Opening Connection...")
                 self.lib.bt.connection.open(evt.address, evt.address_type, CONNECTION_PHY)
             
     def bt_evt_connection_opened(self, evt):
         """ Connection is open. Init the connection info, and start service discovery. """
-        del self.advertising_tags[self.advertising_tags.index(evt.address)]
+        self.advertising_tags.discard(evt.address)
+        self.cancel_release(evt.address)  # The tag is advertising again, so it keeps its slot
         self.connection_info = ConnectionInfo(evt.address, evt.connection)
         
         self.logger.info(f"Connection opened to {evt.address}.")
         
         pawr_addr = self.get_advertising_tag_pawr_addr(evt.address)
         if pawr_addr != None:
-            self.connection_info.pawr_addr = pawr_addr
             self.logger.info(f"Device is known. It will be reassigned to {pawr_addr}.")
+        else:
+            pawr_addr = self.tags.allocate()
+            if pawr_addr == None:
+                self.logger.error("No free PAwR response slots. Closing connection.")
+                self.lib.bt.connection.close(evt.connection)
+                return
+            self.connection_info.new_tag = True
+            self.logger.info(f"Device is new. It will be assigned to {pawr_addr}.")
+        self.connection_info.pawr_addr = pawr_addr
             
         self.logger.info("Dicovering services...")
         self.lib.bt.gatt.discover_primary_services_by_uuid(self.connection_info.conn_handle, BLE_SENSOR_PAWR_SERVICE_UUID)
@@ -139,19 +171,13 @@ class PawrAdvertiser(BluetoothApp):
             
             case ConnectionStates.WRITE_SUBEVENT:
                 self.log.info("Characteristics discovered.")
-                if self.connection_info.pawr_addr != None:
-                    subevent = self.connection_info.pawr_addr[0]
-                else:
-                    subevent = self.subevent_count
+                subevent = self.connection_info.pawr_addr[0]
                 self.lib.bt.gatt.write_characteristic_value(self.connection_info.conn_handle, self.connection_info.char_handles[0], subevent.to_bytes(1, byteorder='big'))
                 self.connection_info.state = ConnectionStates.WRITE_RESPONSE_SLOT
             
             case ConnectionStates.WRITE_RESPONSE_SLOT:
                 self.log.info("Subevent written to peripheral.")
-                if self.connection_info.pawr_addr != None:
-                    response_slot = self.connection_info.pawr_addr[1]
-                else:
-                    response_slot = self.response_slot_count
+                response_slot = self.connection_info.pawr_addr[1]
                 self.lib.bt.gatt.write_characteristic_value(self.connection_info.conn_handle, self.connection_info.char_handles[1], response_slot.to_bytes(1, byteorder='big'))
                 self.connection_info.state = ConnectionStates.PAST_TRANSFER
                 
@@ -170,20 +196,18 @@ class PawrAdvertiser(BluetoothApp):
             resend = False
             while subevents_left > 0:
                 response_slot_start = 0
-                response_slot_count = len(self.tags[subevent])
+                response_slot_count = self.tags.slot_count(subevent)
                 payload = []
-                if len(self.tag_waiting_list) > 0:  # There were missing responses
+                if self.tags.waiting_count > 0:  # There were missing responses
                     resend = True
-                    for i, (target_subevent, target_response_slot) in enumerate(self.tag_waiting_list):
-                        if target_subevent == subevent:
-                            address = target_response_slot  
-                            payload.append(address)
-                            self.logger.info(f"Reading sensor at ({subevent}, {target_response_slot}).")
+                    for target_response_slot in self.tags.waiting_slots(subevent):
+                        payload.append(target_response_slot)
+                        self.logger.info(f"Reading sensor at ({subevent}, {target_response_slot}).")
                     
                 elif resend == False:
                     payload.append(PAWR_BROADCAST_ADDRESS)
                     self.logger.info(f"Reading all sensors in subevent {subevent}.")
-                    self.add_tags_to_waiting_list(subevent, response_slot_start, response_slot_count)
+                    self.tags.wait_for_subevent(subevent)
  
 
                 payload[:0] = [len(payload)]  # Add the header len to the payload start
@@ -199,20 +223,53 @@ class PawrAdvertiser(BluetoothApp):
                 subevents_left = subevents_left - 1
             
             self.read_sensor_values = False
-            threading.Timer(PAWR_INTERVAL * 1.25 / 1000 * 1.5, self.check_for_missing_responses).start()  # Check for missing responses in ~1.5x PAwR interval
+            self.scheduler.call_later(PAWR_INTERVAL * 1.25 / 1000 * 1.5, self.check_for_missing_responses)  # Check for missing responses in ~1.5x PAwR interval
+
+        elif self.compact_response_slots == True:
+            subevent = evt.subevent_start
+            for _ in range(evt.subevent_data_count):
+                move = self.tags.plan_compaction(subevent)
+                if move != None:
+                    tag, new_response_slot = move
+                    self.logger.info(f"Moving sensor at ({subevent}, {tag.response_slot}) to response slot {new_response_slot}.")
+                    payload = [1, tag.response_slot, PawrOpCodes.REASSIGN_RESPONSE_SLOT.value, new_response_slot]
+                    self.lib.bt.pawr_advertiser.set_subevent_data(self.pawr_advertising_set_handle, subevent, 0, self.tags.slot_count(subevent),
+                                                                  bytes(payload))
+                subevent = (subevent + 1) % PAWR_SUBEVENTS
+            self.compact_response_slots = False
             
     def bt_evt_pawr_advertiser_response_report(self, evt):
         """ Receives the response data and pushes it to the DataProcessor queue. """
-        tag_pawr_addr = (evt.subevent, evt.response_slot)
+        received_ns = time.monotonic_ns()
         if evt.data_status == 0:
             self.logger.info(f"Response receiveved in slot: {evt.response_slot}, data: {evt.data}, data_status: {evt.data_status}")
+            tag = self.tags.get_by_pawr_addr(evt.subevent, evt.response_slot)
+            if tag == None:
+                tag = self.tags.get_pending_move(evt.subevent, evt.response_slot)
+                if tag == None:
+                    self.logger.error(f"Response received from unassigned PAwR address ({evt.subevent}, {evt.response_slot}).")
+                    return
+                self.tags.move(tag)  # The tag moved, but its acknowledgement was lost
+            elif tag.pending_response_slot != None:
+                if evt.data[1] == PawrOpCodes.REASSIGN_RESPONSE_SLOT.value:
+                    self.tags.move(tag)
+                    return
+                self.tags.cancel_move(tag)  # The tag is still using its old slot, so it did not get the command
+
             if evt.data[1] == PawrOpCodes.READ_SENSOR_VALUES.value:
-                del self.tag_waiting_list[self.tag_waiting_list.index(tag_pawr_addr)]  # Response received -> delete tag from waiting list
+                self.tags.clear_waiting(evt.subevent, evt.response_slot)  # Response received -> stop waiting for the tag
+                missed_responses = tag.missed_responses
+                if not tag.synced:
+                    self.cancel_release(tag.ble_address)
+                    self.tags.set_synced(tag, True)  # The tag never lost the sync, only its responses were lost
+                tag.missed_responses = 0
                 sensor_data = evt.data[2:]
-                sensor_address = self.tags[evt.subevent][evt.response_slot].ble_address 
-                self.data_processing_thread.queue.put((sensor_data, sensor_address))
+                sensor_address = tag.ble_address 
+                timestamp = self.clock.timestamp(evt.counter, self.response_slot_offset_ns(evt.subevent, evt.response_slot), received_ns)
+                if not self.pipeline.put((sensor_data, sensor_address, timestamp, evt.rssi, missed_responses)):
+                    self.logger.warning(f"Data pipeline full, dropping reading from {sensor_address}: {self.pipeline.stats()}")
         else:
-            if tag_pawr_addr in self.tag_waiting_list:
+            if self.tags.is_waiting(evt.subevent, evt.response_slot):
                 self.logger.error(f"Failed response receiveved in slot: {evt.response_slot}, data: {evt.data}, data_status: {evt.data_status}")
     
     def bt_evt_connection_closed(self, evt):
@@ -221,41 +278,43 @@ class PawrAdvertiser(BluetoothApp):
         
         # We assume that the tag is synced if it closes the connection while we are in the PAST transfer. We will only know for sure once we try to read the sensor data.
         if evt.reason == 0x1013 and self.connection_info.state == ConnectionStates.PAST_TRANSFER:
-            if self.connection_info.pawr_addr != None:
-                subevent = self.connection_info.pawr_addr[0]
-                response_slot = self.connection_info.pawr_addr[1]
-                self.tags[subevent][response_slot].synced = True
-            else:
-                subevent = self.subevent_count
-                response_slot = self.response_slot_count
+            subevent, response_slot = self.connection_info.pawr_addr
+            if self.connection_info.new_tag:
                 synced_tag = SensorTag(self.connection_info.ble_address, subevent, response_slot)
-                synced_tag.synced = True
-                self.tags[subevent].append(synced_tag)
-            
-                # Check if the subevent is full, and move on to the next one if needed
-                if self.response_slot_count >= (PAWR_RESPONSE_SLOTS - 1) and self.subevent_count < (PAWR_SUBEVENTS - 1):
-                    self.response_slot_count = 0
-                    self.subevent_count = self.subevent_count + 1
-                    self.tags.append([])  # Append empty list for the next subevent
-                else:
-                    self.response_slot_count = self.response_slot_count + 1
+                self.tags.add(synced_tag)
+            else:
+                synced_tag = self.tags.get_by_pawr_addr(subevent, response_slot)
+            self.tags.set_synced(synced_tag, True)
+        elif self.connection_info.new_tag:
+            # Onboarding failed, so free the reserved slot
+            self.tags.release(*self.connection_info.pawr_addr)
+        elif self.connection_info.pawr_addr != None:
+            # Re-onboarding failed, keep the slot for another sync timeout in case the tag advertises again
+            self.schedule_release(self.tags.get_by_pawr_addr(*self.connection_info.pawr_addr))
 
-            self.synced_tags += 1
-                
         self.connection_info = None
         self.lib.bt.scanner.start(
             self.lib.bt.scanner.SCAN_PHY_SCAN_PHY_1M,
             self.lib.bt.scanner.DISCOVER_MODE_DISCOVER_OBSERVATION)
         
-    def sensor_data_period_handler(self):
-        """ This function runs in a loop and lets the main application know when we want to read the sensor values through the read_sensor_values boolean. """
-        self.logger.info(f"Sensor reading period is set to {PAWR_SENSOR_READ_PERIOD_M} minutes.") 
-        while True:
-            time.sleep(PAWR_SENSOR_READ_PERIOD_S)
-            if self.synced_tags > 0:
-                self.read_sensor_values = True
-            else:
-                self.logger.info("No synced tags. Skipping reading!")
+    def start_read_cycle(self):
+        """ Request the sensor values on the next subevent data request, unless the data pipeline cannot take the responses. """
+        if self.tags.synced_count == 0:
+            self.logger.info("No synced tags. Skipping reading!")
+        elif self.pipeline.free() < self.tags.synced_count:
+            self.logger.warning(f"Data pipeline backed up. Skipping reading! {self.pipeline.stats()}")
+        else:
+            self.logger.debug(f"Data pipeline: {self.pipeline.stats()}")
+            self.read_sensor_values = True
+
+    def start_compaction(self):
+        """ Move one tag per sparse subevent on the next subevent data request that does not read the sensors. """
+        self.compact_response_slots = True
+
+    def housekeeping(self):
+        """ Periodically log the timing jitter of the event loop and the state of the data pipeline. """
+        self.logger.info(f"Event loop: {self.scheduler.stats()}. Data pipeline: {self.pipeline.stats()}")
+        self.scheduler.reset_stats()
                 
     def is_sensor(self, adv_data):
         """ Check if the advertising device is one of our sensors. """
@@ -266,31 +325,50 @@ class PawrAdvertiser(BluetoothApp):
         else:
             return False
 
-    def add_tags_to_waiting_list(self, subevent, response_slot_start, response_slot_count):
-        """ Add the tags from which we are expecting responses to the waiting list. """
-        for rs in range(response_slot_count):
-            tag_pawr_addr = (subevent, response_slot_start + rs)
-            if tag_pawr_addr not in self.tag_waiting_list and self.tags[tag_pawr_addr[0]][tag_pawr_addr[1]].synced == True:
-                self.tag_waiting_list.append(tag_pawr_addr)
-            
     def check_for_missing_responses(self):
-        """ Schedule a resend ff there are tags in the waiting list after we have received the response events. """
-        if len(self.tag_waiting_list) > 0:
+        """ Schedule a resend if there are tags in the waiting list after we have received the response events. """
+        if self.tags.waiting_count > 0:
             self.read_sensor_values = True
-            for tag_pawr_addr in self.tag_waiting_list:
-                self.logger.error(f"Tag at PAwR address {tag_pawr_addr} did not respond to the previous PAwR command. Resend scheduled!")
-                self.tags[tag_pawr_addr[0]][tag_pawr_addr[1]].missed_responses += 1
+            for tag in self.tags.waiting_tags():
+                self.logger.error(f"Tag at PAwR address {(tag.subevent, tag.response_slot)} did not respond to the previous PAwR command. Resend scheduled!")
+                tag.missed_responses += 1
                 
-                if self.tags[tag_pawr_addr[0]][tag_pawr_addr[1]].missed_responses >= PAWR_MAX_ALLOWED_MISSED_RESPONSES:
-                    self.tags[tag_pawr_addr[0]][tag_pawr_addr[1]].synced = False
-                    self.synced_tags -= 1
-                    del self.tag_waiting_list[self.tag_waiting_list.index(tag_pawr_addr)]
-                    
+                if tag.missed_responses >= PAWR_MAX_ALLOWED_MISSED_RESPONSES:
+                    self.tags.set_synced(tag, False)
+                    self.schedule_release(tag)
+
+    def schedule_release(self, tag):
+        """ Keep the slot of a tag that stopped responding until the tag must have dropped the sync, so that the slot
+        is not handed to another tag while this one may still answer in it. A tag that advertises again before then
+        gets its old slot back. """
+        delay_s = PAWR_OUT_OF_SYNC_LIMIT * PAWR_INTERVAL * PAWR_INTERVAL_UNIT_NS / 1e9 * PAWR_OUT_OF_SYNC_MARGIN
+        self.cancel_release(tag.ble_address)
+        self.release_timers[tag.ble_address] = self.scheduler.call_later(delay_s, self.release_tag, tag)
+
+    def cancel_release(self, ble_address):
+        timer = self.release_timers.pop(ble_address, None)
+        if timer != None:
+            timer.cancel()
+
+    def release_tag(self, tag):
+        """ Free the slot of a tag that has been out of sync for longer than the sync timeout of the tag. """
+        self.release_timers.pop(tag.ble_address, None)
+        if tag.synced or self.tags.get_by_address(tag.ble_address) is not tag:
+            return
+        if self.connection_info != None and self.connection_info.ble_address == tag.ble_address:
+            return  # Being onboarded again into the same slot
+        self.logger.info(f"Releasing PAwR address {(tag.subevent, tag.response_slot)} of sensor tag {tag.ble_address}.")
+        self.tags.remove(tag)
+
+    def response_slot_offset_ns(self, subevent, response_slot):
+        """ Time from the start of a PAwR event to the given response slot. """
+        return ((subevent * PAWR_SUBEVENT_INTERVAL + PAWR_RESPONSE_SLOT_DELAY) * PAWR_INTERVAL_UNIT_NS
+                + response_slot * PAWR_RESPONSE_SLOT_SPACING * PAWR_RESPONSE_SLOT_SPACING_UNIT_NS)
+
     def get_advertising_tag_pawr_addr(self, ble_address):
         """ Find the assigned subevent and response slot for a specific BLE address """
-        for i in range(len(self.tags)):
-            for j in range(len(self.tags[i])):
-                if self.tags[i][j].ble_address == ble_address:
-                    return (i, j)
+        tag = self.tags.get_by_address(ble_address)
+        if tag != None:
+            return (tag.subevent, tag.response_slot)
                 
-        return None
\ No newline at end of file
+        return None
@@ -0,0 +1,116 @@
+"""
+Filename: PawrClock.py
+Author: Markus Andersson
+Date: January 11, 2025
+
+Description:
+Class for deriving reading timestamps from the PAwR event counter instead of the host clock.
+
+License: MIT License
+
+License:
+This file is part of an open-source project and is distributed under the terms
+of the MIT License. You may obtain a copy of the License at:
+https://opensource.org/licenses/MIT
+
+Copyright (c) 2025, Markus Andersson. All rights reserved.
+"""
+
+import datetime
+import logging
+import time
+
+PAWR_CLOCK_SKEW_WINDOW_EVENTS = 720  # Number of PAwR events over which the host latency floor is measured
+PAWR_CLOCK_MAX_SKEW_NS = 20_000_000  # Re-anchor if the latency floor drifts more than this from the radio time
+PAWR_CLOCK_MAX_SLEW_PPM = 100        # Upper bound for the crystal drift corrected per window, so a host backlog cannot move the timestamps
+PAWR_CLOCK_MAX_WALL_STEP_NS = 100_000_000  # Re-map to UTC if the wall clock has been stepped more than this, e.g. by NTP after boot
+
+
+class PawrClock():
+    """ Maps (event counter, subevent, response slot) to UTC time.
+
+    The first response anchors a PAwR event index to the host monotonic clock. Every later response is placed on
+    the PAwR event grid from its counter alone, so its timestamp does not depend on how late the host handles it.
+    The monotonic clock is mapped to UTC at startup, and re-mapped by check_wall_clock() only when the wall clock has
+    been stepped, e.g. by the first NTP sync of a host without an RTC. Small adjustments do not move the timestamps.
+    """
+    def __init__(self, interval_ns, counter_modulus=256):
+        self.logger = logging.getLogger(__name__)
+        self.interval_ns = interval_ns
+        self.counter_modulus = counter_modulus
+        self.utc_anchor_ns = time.time_ns()
+        self.monotonic_anchor_ns = time.monotonic_ns()
+        self.reset()
+
+    def reset(self):
+        """ Forget the event anchor, e.g. when the radio has rebooted and its event counter restarted. """
+        self.event_anchor_index = None
+        self.event_anchor_ns = None
+        self.skew_window_start_index = None
+        self.skew_window_min_ns = None
+
+    def check_wall_clock(self):
+        """ Re-map the monotonic clock to UTC if the wall clock has been stepped since the last mapping. """
+        utc_ns = time.time_ns()
+        monotonic_ns = time.monotonic_ns()
+        step_ns = utc_ns - (self.utc_anchor_ns + (monotonic_ns - self.monotonic_anchor_ns))
+        if abs(step_ns) > PAWR_CLOCK_MAX_WALL_STEP_NS:
+            self.utc_anchor_ns = utc_ns
+            self.monotonic_anchor_ns = monotonic_ns
+            self.logger.warning(f"Wall clock stepped by {step_ns / 1e9:.3f} s. PAwR clock re-mapped to UTC.")
+
+    def event_index(self, counter, event_start_estimate_ns):
+        """ Unwrap the event counter to the event index closest to the estimated event start. """
+        estimated_index = self.event_anchor_index + round((event_start_estimate_ns - self.event_anchor_ns) / self.interval_ns)
+        wraps = round((estimated_index - counter) / self.counter_modulus)
+        return counter + wraps * self.counter_modulus
+
+    def timestamp(self, counter, offset_ns, received_ns=None):
+        """ Return the UTC time of a response sent offset_ns after the start of the event with the given counter. """
+        if received_ns == None:
+            received_ns = time.monotonic_ns()
+        event_start_estimate_ns = received_ns - offset_ns
+
+        if self.event_anchor_index == None:
+            self.event_anchor_index = counter
+            self.event_anchor_ns = event_start_estimate_ns
+            self.logger.info(f"PAwR clock anchored to event counter {counter}.")
+
+        index = self.event_index(counter, event_start_estimate_ns)
+        event_start_ns = self.event_anchor_ns + (index - self.event_anchor_index) * self.interval_ns
+        self.track_skew(index, event_start_estimate_ns - event_start_ns)
+
+        return self.utc_from_monotonic(event_start_ns + offset_ns)
+
+    def track_skew(self, index, latency_ns):
+        """ Keep the anchor aligned with the radio clock.
+
+        The host can only see a response after it was sent, so a negative latency means the radio clock runs ahead of
+        the anchor. A latency floor that grows over a window of events means it runs behind.
+        """
+        if latency_ns < 0:
+            self.event_anchor_ns += latency_ns
+            self.logger.debug(f"PAwR clock re-anchored by {latency_ns / 1e6:.3f} ms.")
+            self.skew_window_start_index = None
+            return
+
+        if self.skew_window_start_index == None:
+            self.skew_window_start_index = index
+            self.skew_window_min_ns = latency_ns
+            return
+
+        self.skew_window_min_ns = min(self.skew_window_min_ns, latency_ns)
+        window_events = index - self.skew_window_start_index
+        if window_events >= PAWR_CLOCK_SKEW_WINDOW_EVENTS:
+            if self.skew_window_min_ns > PAWR_CLOCK_MAX_SKEW_NS:
+                max_slew_ns = window_events * self.interval_ns * PAWR_CLOCK_MAX_SLEW_PPM // 1_000_000
+                slew_ns = min(self.skew_window_min_ns, max_slew_ns)
+                self.event_anchor_ns += slew_ns
+                self.logger.info(f"PAwR clock re-anchored by {slew_ns / 1e6:.3f} ms.")
+            self.skew_window_start_index = None
+
+    def utc_from_monotonic(self, monotonic_ns):
+        """ Convert a host monotonic time to UTC using the mapping taken at startup. """
+        utc_ns = self.utc_anchor_ns + (monotonic_ns - self.monotonic_anchor_ns)
+        seconds, remainder_ns = divmod(utc_ns, 1_000_000_000)
+        return datetime.datetime.fromtimestamp(seconds, tz=datetime.timezone.utc) + datetime.timedelta(microseconds=remainder_ns // 1000)
@@ -24,6 +24,7 @@ class SensorTag():
         self.ble_address = ble_address
         self.subevent = subevent
         self.response_slot = response_slot
+        self.pending_response_slot = None  # Slot that the tag has been asked to move to during compaction
         self.missed_responses = None
         self._synced = False
         self.logger = logging.getLogger(__name__)
@@ -0,0 +1,180 @@
+"""
+Filename: TagRegistry.py
+Author: Markus Andersson
+Date: January 11, 2025
+
+Description:
+Class for looking up the tags by BLE address and PAwR address, keeping track of synced and waiting tags, and
+allocating the PAwR addresses.
+
+License: MIT License
+
+License:
+This file is part of an open-source project and is distributed under the terms
+of the MIT License. You may obtain a copy of the License at:
+https://opensource.org/licenses/MIT
+
+Copyright (c) 2025, Markus Andersson. All rights reserved.
+"""
+
+import logging
+
+
+def iter_bits(bitset):
+    """ Yield the index of every set bit, lowest first. """
+    while bitset:
+        lowest = bitset & -bitset
+        yield lowest.bit_length() - 1
+        bitset ^= lowest
+
+
+class TagRegistry():
+    """ Tags indexed by BLE address and by PAwR address (subevent, response slot).
+
+    The synced and waiting state is kept as one bitset per subevent, where bit n is response slot n.
+    All per-event operations are O(1) per tag, or O(1) per subevent for the bitset operations.
+
+    New tags are placed in the least loaded subevent, in its lowest free response slot. Slots of tags that drop
+    from sync are freed, and compaction moves the tags at the end of a sparse subevent into the holes, so that the
+    response window of every subevent stays as short as possible.
+    """
+    def __init__(self, subevents, response_slots):
+        self.logger = logging.getLogger(__name__)
+        self.subevents = subevents
+        self.response_slots = response_slots
+        self.by_address = {}
+        self.by_pawr_addr = {}
+        self.pending_moves = {}  # (subevent, new response slot) -> tag that has been asked to move there
+        self.occupied = [0] * subevents  # Assigned or reserved response slots
+        self.synced = [0] * subevents
+        self.waiting = [0] * subevents  # Tags that we are expecting a response from
+        self.synced_count = 0
+        self.waiting_count = 0
+
+    def __len__(self):
+        return len(self.by_address)
+
+    def add(self, tag):
+        """ Register a tag at its PAwR address. """
+        self.by_address[tag.ble_address] = tag
+        self.by_pawr_addr[(tag.subevent, tag.response_slot)] = tag
+        self.occupied[tag.subevent] |= 1 << tag.response_slot
+
+    def remove(self, tag):
+        """ Unregister a tag and free its response slot. """
+        self.set_synced(tag, False)
+        self.cancel_move(tag)
+        del self.by_address[tag.ble_address]
+        del self.by_pawr_addr[(tag.subevent, tag.response_slot)]
+        self.release(tag.subevent, tag.response_slot)
+
+    def allocate(self):
+        """ Reserve the lowest free response slot of the least loaded subevent. Returns None if every slot is taken. """
+        subevent = min(range(self.subevents), key=lambda i: self.occupied[i].bit_count())
+        response_slot = (~self.occupied[subevent] & (self.occupied[subevent] + 1)).bit_length() - 1
+        if response_slot >= self.response_slots:
+            return None
+        self.occupied[subevent] |= 1 << response_slot
+        return (subevent, response_slot)
+
+    def release(self, subevent, response_slot):
+        """ Free a reserved response slot. """
+        self.occupied[subevent] &= ~(1 << response_slot)
+
+    def plan_compaction(self, subevent):
+        """ If the subevent is sparse, ask the tag in the highest slot to move to the lowest free slot.
+
+        Returns the planned move as (tag, new response slot), or None. The new slot is reserved until the move is resolved.
+        """
+        occupied = self.occupied[subevent]
+        highest_slot = occupied.bit_length() - 1
+        lowest_free_slot = (~occupied & (occupied + 1)).bit_length() - 1
+        if lowest_free_slot >= highest_slot:
+            return None  # No holes below the last tag
+        tag = self.by_pawr_addr.get((subevent, highest_slot))
+        if tag == None or not tag.synced or tag.pending_response_slot != None:
+            return None
+        self.occupied[subevent] |= 1 << lowest_free_slot
+        self.pending_moves[(subevent, lowest_free_slot)] = tag
+        tag.pending_response_slot = lowest_free_slot
+        return (tag, lowest_free_slot)
+
+    def get_pending_move(self, subevent, response_slot):
+        """ Tag that has been asked to move to the given PAwR address, if any. """
+        return self.pending_moves.get((subevent, response_slot))
+
+    def move(self, tag):
+        """ Commit a pending move once the tag has acknowledged it, or responded from its new slot. """
+        new_slot = tag.pending_response_slot
+        del self.pending_moves[(tag.subevent, new_slot)]
+        tag.pending_response_slot = None
+
+        old_bit = 1 << tag.response_slot
+        new_bit = 1 << new_slot
+        for bitsets in (self.synced, self.waiting):
+            if bitsets[tag.subevent] & old_bit:
+                bitsets[tag.subevent] = (bitsets[tag.subevent] & ~old_bit) | new_bit
+        self.occupied[tag.subevent] &= ~old_bit
+        del self.by_pawr_addr[(tag.subevent, tag.response_slot)]
+        tag.response_slot = new_slot
+        self.by_pawr_addr[(tag.subevent, new_slot)] = tag
+        self.logger.info(f"Sensor tag with address {tag.ble_address} moved to subevent: {tag.subevent}, response slot: {new_slot}.")
+
+    def cancel_move(self, tag):
+        """ Drop a pending move, e.g. when the tag is still responding from its old slot. """
+        if tag.pending_response_slot == None:
+            return
+        del self.pending_moves[(tag.subevent, tag.pending_response_slot)]
+        self.release(tag.subevent, tag.pending_response_slot)
+        tag.pending_response_slot = None
+
+    def get_by_address(self, ble_address):
+        return self.by_address.get(ble_address)
+
+    def get_by_pawr_addr(self, subevent, response_slot):
+        return self.by_pawr_addr.get((subevent, response_slot))
+
+    def slot_count(self, subevent):
+        """ Number of response slots needed to cover every tag in the subevent. """
+        return self.occupied[subevent].bit_length()
+
+    def set_synced(self, tag, synced):
+        """ Update the sync state of a tag. A tag that drops from sync is no longer waited for. """
+        bit = 1 << tag.response_slot
+        was_synced = bool(self.synced[tag.subevent] & bit)
+        tag.synced = synced
+        if synced and not was_synced:
+            self.synced[tag.subevent] |= bit
+            self.synced_count += 1
+        elif not synced and was_synced:
+            self.synced[tag.subevent] &= ~bit
+            self.synced_count -= 1
+            self.clear_waiting(tag.subevent, tag.response_slot)
+
+    def wait_for_subevent(self, subevent):
+        """ Expect a response from every synced tag in the subevent. """
+        added = self.synced[subevent] & ~self.waiting[subevent]
+        self.waiting[subevent] |= added
+        self.waiting_count += added.bit_count()
+
+    def clear_waiting(self, subevent, response_slot):
+        """ Stop waiting for a tag. Returns False if we were not waiting for it. """
+        bit = 1 << response_slot
+        if not self.waiting[subevent] & bit:
+            return False
+        self.waiting[subevent] &= ~bit
+        self.waiting_count -= 1
+        return True
+
+    def is_waiting(self, subevent, response_slot):
+        return bool(self.waiting[subevent] & (1 << response_slot))
+
+    def waiting_slots(self, subevent):
+        """ Response slots in the subevent that we are expecting a response from. """
+        return iter_bits(self.waiting[subevent])
+
+    def waiting_tags(self):
+        """ All tags that we are expecting a response from. """
+        return [self.by_pawr_addr[(subevent, response_slot)]
+                for subevent, bitset in enumerate(self.waiting) if bitset
+                for response_slot in iter_bits(bitset)]
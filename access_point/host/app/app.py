@@ -18,9 +18,10 @@ Copyright (c) 2025, Markus Andersson. All rights reserved.
 
 from PawrAdvertiser import *
 from DataProcessor import *
+from AlertEngine import *
 import os.path
 import sys
-from queue import Queue
+from utils.pipeline import SpscRing
 from utils.ble import *
 from DatabaseClient import *
 from config import *
@@ -50,13 +51,34 @@ if __name__ == "__main__":
     # Start the database client
     db_client = DatabaseClient(MQTT_HOST, MQTT_PORT)
     db_client.subscribe(MQTT_TOPIC)
+    db_client.subscribe(f"{MQTT_TOPIC}/+")
+
+    # Alert rules, evaluated on every reading before it is published
+    alert_rules = [
+        ThresholdRule("temperature", "temperature", low=ALERT_TEMPERATURE_LOW, high=ALERT_TEMPERATURE_HIGH, hysteresis=ALERT_TEMPERATURE_HYSTERESIS),
+        ThresholdRule("humidity", "humidity", high=ALERT_HUMIDITY_HIGH, hysteresis=ALERT_HUMIDITY_HYSTERESIS),
+        RateOfChangeRule("temperature_rate", "temperature", max_change=ALERT_TEMPERATURE_RATE_PER_H, per_s=3600,
+                         window_s=ALERT_TEMPERATURE_RATE_WINDOW_S, min_change=ALERT_TEMPERATURE_RATE_MIN_CHANGE),
+        ThresholdRule("low_battery", "battery_level", low=ALERT_BATTERY_LOW, hysteresis=ALERT_BATTERY_HYSTERESIS),
+        OutlierRule("temperature_outlier", "temperature", ANOMALY_Z_THRESHOLD, ANOMALY_EWMA_ALPHA, ANOMALY_WARMUP_READINGS),
+        OutlierRule("humidity_outlier", "humidity", ANOMALY_Z_THRESHOLD, ANOMALY_EWMA_ALPHA, ANOMALY_WARMUP_READINGS),
+        StuckRule("temperature_stuck", "temperature", ANOMALY_STUCK_AFTER_S, ALERT_STALE_AFTER_S),
+        StuckRule("humidity_stuck", "humidity", ANOMALY_STUCK_AFTER_S, ALERT_STALE_AFTER_S),
+    ]
+    alert_engine = AlertEngine(SITE_ID, alert_rules, ALERT_SENSOR_RULES, ALERT_DEBOUNCE_READINGS, ALERT_STALE_AFTER_S)
 
     # Start the dataprocessor 
-    q = Queue()
+    q = SpscRing(DATA_PIPELINE_CAPACITY)
     data_processing_thread = DataProcessor(queue=q, 
                                            mqtt_host=MQTT_HOST,
                                            mqtt_port=MQTT_PORT,
-                                           mqtt_topic=MQTT_TOPIC)
+                                           mqtt_topic=f"{MQTT_TOPIC}/{SITE_ID}",
+                                           mqtt_encoding=MQTT_ENCODING,
+                                           batch_size=MQTT_BATCH_SIZE,
+                                           batch_timeout_s=MQTT_BATCH_TIMEOUT_S,
+                                           alert_engine=alert_engine,
+                                           alert_topic=ALERT_TOPIC,
+                                           alert_check_period_s=ALERT_CHECK_PERIOD_S)
     data_processing_thread.start()
 
     # Start the BLE-app
@@ -25,12 +25,14 @@ Application utility module
 # 3. This notice may not be removed or altered from any source distribution.
 
 import argparse
+import heapq
 import itertools
 import logging
 import os.path
 import socket
 import sys
 import threading
+import time
 import traceback
 import bgapi
 from bgapi.connector import ConnectorException
@@ -56,6 +58,74 @@ class CommandFailedError(bgapi.bglib.CommandError):
 
 bgapi.bglib.CommandFailedError = CommandFailedError
 
+class Timer:
+    """ Handle of a callback scheduled with Scheduler. """
+    def __init__(self, deadline, period, callback, args):
+        self.deadline = deadline
+        self.period = period
+        self.callback = callback
+        self.args = args
+        self.cancelled = False
+
+    def cancel(self):
+        """ Prevent further executions of the callback. """
+        self.cancelled = True
+
+class Scheduler:
+    """ Deadline-ordered timers executed by the main program loop instead of dedicated threads. """
+    def __init__(self):
+        self._heap = []
+        self._seq = itertools.count()
+        self.reset_stats()
+
+    def call_later(self, delay, callback, *args):
+        """ Run callback once after delay seconds. """
+        return self._push(Timer(time.monotonic() + delay, None, callback, args))
+
+    def call_every(self, period, callback, *args):
+        """ Run callback every period seconds. Deadlines are fixed-rate, so jitter does not accumulate. """
+        return self._push(Timer(time.monotonic() + period, period, callback, args))
+
+    def _push(self, timer):
+        heapq.heappush(self._heap, (timer.deadline, next(self._seq), timer))
+        return timer
+
+    def timeout(self, max_timeout):
+        """ Seconds until the next deadline, capped at max_timeout. """
+        while self._heap and self._heap[0][2].cancelled:
+            heapq.heappop(self._heap)
+        if not self._heap:
+            return max_timeout
+        return min(max_timeout, max(0.0, self._heap[0][0] - time.monotonic()))
+
+    def run_due(self):
+        """ Execute every callback whose deadline has passed. """
+        now = time.monotonic()
+        while self._heap and self._heap[0][0] <= now:
+            _, _, timer = heapq.heappop(self._heap)
+            if timer.cancelled:
+                continue
+            lateness = now - timer.deadline
+            self.fired += 1
+            self.lateness_total += lateness
+            self.lateness_max = max(self.lateness_max, lateness)
+            if timer.period is not None:
+                # Skip the missed periods instead of firing a burst if the loop was blocked
+                missed = int(lateness // timer.period)
+                timer.deadline += (missed + 1) * timer.period
+                self._push(timer)
+            timer.callback(*timer.args)
+
+    def reset_stats(self):
+        """ Start a new jitter measurement window. """
+        self.fired = 0
+        self.lateness_total = 0.0
+        self.lateness_max = 0.0
+
+    def stats(self):
+        mean = self.lateness_total / self.fired if self.fired else 0.0
+        return f"{self.fired} timers fired, lateness mean {mean * 1000:.1f} ms, max {self.lateness_max * 1000:.1f} ms"
+
 class GenericApp(threading.Thread):
     """ Generic application class. """
     _id = itertools.count(0)
@@ -66,6 +136,8 @@ class GenericApp(threading.Thread):
         # Set the ready event in the child classes to feed the watchdog
         self.ready = threading.Event()
         self._run = threading.Event()
+        # Timers executed in the main program loop
+        self.scheduler = Scheduler()
         super().__init__()
 
     def event_handler(self, evt):
@@ -99,7 +171,8 @@ class GenericApp(threading.Thread):
                 # timeout=None: minimal CPU usage, KeyboardInterrupt not recognized until the next event.
                 # timeout=0: maximal CPU usage, KeyboardInterrupt recognized immediately.
                 # See the documentation of Queue.get method for details.
-                evt = self.lib.get_event(timeout=0.1)
+                self.scheduler.run_due()
+                evt = self.lib.get_event(timeout=self.scheduler.timeout(0.1))
                 if evt is None:
                     continue
                 # Convert event parameters with errorcode datatype into Status objects
@@ -11,4 +11,40 @@ TIMESCALE_DATABASE = "sensor_monitoring"
 
 MQTT_HOST = "localhost"
 MQTT_PORT = 1883
-MQTT_TOPIC = "sensor_data"
\ No newline at end of file
+MQTT_TOPIC = "sensor_data"
+
+# Readings are published to MQTT_TOPIC/SITE_ID. Use "packed" to send batches of binary records instead of one JSON document per reading.
+SITE_ID = "apartment"
+MQTT_ENCODING = "json"
+MQTT_BATCH_SIZE = 64
+MQTT_BATCH_TIMEOUT_S = 1.0
+
+# Number of readings that can wait between the BLE event loop and the DataProcessor. Read cycles are skipped while it is full.
+DATA_PIPELINE_CAPACITY = 1024
+
+# Alerts are evaluated on every reading and published as JSON to ALERT_TOPIC. Set a limit to None to disable it.
+# Threshold rules fire on the first reading outside their limits and rely on the hysteresis against flapping. The
+# rate of change rule fires, or resolves, after ALERT_DEBOUNCE_READINGS consecutive readings agree. Its rate is taken
+# over at least ALERT_TEMPERATURE_RATE_WINDOW_S, as the jitter of a tag between two readings is larger than the limit.
+ALERT_TOPIC = f"alerts/{SITE_ID}"
+ALERT_TEMPERATURE_LOW = 15.0
+ALERT_TEMPERATURE_HIGH = 30.0
+ALERT_TEMPERATURE_HYSTERESIS = 0.5
+ALERT_HUMIDITY_HIGH = 70.0
+ALERT_HUMIDITY_HYSTERESIS = 2.0
+ALERT_TEMPERATURE_RATE_PER_H = 5.0
+ALERT_TEMPERATURE_RATE_WINDOW_S = 10 * 60
+ALERT_TEMPERATURE_RATE_MIN_CHANGE = 0.5  # Smallest change that can fire, against jitter when the window is shortened
+ALERT_BATTERY_LOW = 20
+ALERT_BATTERY_HYSTERESIS = 2
+ALERT_STALE_AFTER_S = 5 * 60
+ALERT_DEBOUNCE_READINGS = 2
+ALERT_CHECK_PERIOD_S = 30  # How often stale sensors are looked for, one read period
+ALERT_SENSOR_RULES = {}  # Lower case BLE address -> rules that replace the site rules of the same name
+
+# Anomaly detection per tag. Outliers are readings more than ANOMALY_Z_THRESHOLD standard deviations from the moving
+# average, a sensor is stuck when it reports the same value for ANOMALY_STUCK_AFTER_S. Published as alerts.
+ANOMALY_Z_THRESHOLD = 4.0
+ANOMALY_EWMA_ALPHA = 0.05  # Weight of a new reading in the moving average, about the last 20 readings
+ANOMALY_WARMUP_READINGS = 20
+ANOMALY_STUCK_AFTER_S = 3 * 60 * 60
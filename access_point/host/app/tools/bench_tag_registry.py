@@ -0,0 +1,124 @@
+"""
+Filename: bench_tag_registry.py
+Author: Markus Andersson
+Date: January 11, 2025
+
+Description:
+Benchmark of the tag bookkeeping of PawrAdvertiser: the nested tag lists with a waiting list it used to have, against
+the TagRegistry. Measures a lookup by BLE address and one full read cycle (expect a response from every synced tag,
+handle the responses, then check for the missing ones).
+
+Run from access_point/host/app: python3 tools/bench_tag_registry.py [tag counts...]
+
+License: MIT License
+
+License:
+This file is part of an open-source project and is distributed under the terms
+of the MIT License. You may obtain a copy of the License at:
+https://opensource.org/licenses/MIT
+
+Copyright (c) 2025, Markus Andersson. All rights reserved.
+"""
+
+import logging
+import os.path
+import random
+import sys
+import time
+
+sys.path.append(os.path.join(os.path.dirname(__file__), ".."))
+from SensorTag import SensorTag
+from TagRegistry import TagRegistry
+
+TAGS_PER_SUBEVENT = 250
+RESPONSE_RATE = 0.99  # Share of the tags that respond in a read cycle
+DEFAULT_TAG_COUNTS = [1000, 10000]
+
+
+class NestedLists():
+    """ The previous bookkeeping: tags[subevent][response_slot], and a list of the PAwR addresses waited for. """
+    def __init__(self, tags):
+        self.tags = [[] for _ in range(max(tag.subevent for tag in tags) + 1)]
+        for tag in tags:
+            self.tags[tag.subevent].append(tag)
+        self.tag_waiting_list = []
+
+    def get_by_address(self, ble_address):
+        for i in range(len(self.tags)):
+            for j in range(len(self.tags[i])):
+                if self.tags[i][j].ble_address == ble_address:
+                    return (i, j)
+        return None
+
+    def read_cycle(self, responding):
+        for subevent in range(len(self.tags)):
+            for rs in range(len(self.tags[subevent])):
+                tag_pawr_addr = (subevent, rs)
+                if tag_pawr_addr not in self.tag_waiting_list and self.tags[subevent][rs].synced == True:
+                    self.tag_waiting_list.append(tag_pawr_addr)
+        for tag_pawr_addr in responding:
+            del self.tag_waiting_list[self.tag_waiting_list.index(tag_pawr_addr)]
+        missing = list(self.tag_waiting_list)
+        self.tag_waiting_list = []
+        return missing
+
+
+class Registry():
+    def __init__(self, tags):
+        self.registry = TagRegistry(max(tag.subevent for tag in tags) + 1, TAGS_PER_SUBEVENT)
+        for tag in tags:
+            self.registry.add(tag)
+            self.registry.set_synced(tag, True)
+
+    def get_by_address(self, ble_address):
+        return self.registry.get_by_address(ble_address)
+
+    def read_cycle(self, responding):
+        for subevent in range(self.registry.subevents):
+            self.registry.wait_for_subevent(subevent)
+        for subevent, response_slot in responding:
+            self.registry.clear_waiting(subevent, response_slot)
+        missing = self.registry.waiting_tags()
+        for tag in missing:
+            self.registry.clear_waiting(tag.subevent, tag.response_slot)
+        return missing
+
+
+def make_tags(count):
+    tags = []
+    for i in range(count):
+        tag = SensorTag(":".join(f"{b:02x}" for b in i.to_bytes(6, "big")), i // TAGS_PER_SUBEVENT, i % TAGS_PER_SUBEVENT)
+        tag.synced = True
+        tags.append(tag)
+    return tags
+
+def time_per_call(function, args_list, min_time_s=0.5):
+    """ Average time of function(*args) over args_list, repeated until at least min_time_s has passed. """
+    calls = 0
+    start = time.perf_counter()
+    while True:
+        for args in args_list:
+            function(*args)
+        calls += len(args_list)
+        elapsed = time.perf_counter() - start
+        if elapsed >= min_time_s:
+            return elapsed / calls
+
+def main():
+    logging.disable(logging.CRITICAL)  # SensorTag logs every sync change
+    tag_counts = [int(arg) for arg in sys.argv[1:]] or DEFAULT_TAG_COUNTS
+    random.seed(0)
+    print(f"{TAGS_PER_SUBEVENT} tags per subevent, {RESPONSE_RATE:.0%} responding, Python {sys.version.split()[0]}")
+    print(f"{'tags':>6}  {'implementation':<14}  {'address lookup':>14}  {'read cycle':>12}")
+    for count in tag_counts:
+        tags = make_tags(count)
+        lookups = [(tag.ble_address,) for tag in random.sample(tags, min(count, 200))]
+        responding = [(tag.subevent, tag.response_slot) for tag in tags if random.random() < RESPONSE_RATE]
+        for name, implementation in (("nested lists", NestedLists(tags)), ("TagRegistry", Registry(tags))):
+            lookup_s = time_per_call(implementation.get_by_address, lookups)
+            cycle_s = time_per_call(implementation.read_cycle, [(responding,)])
+            print(f"{count:>6}  {name:<14}  {lookup_s * 1e6:>11.2f} us  {cycle_s * 1e3:>9.2f} ms")
+
+
+if __name__ == "__main__":
+    main()
@@ -14,6 +14,7 @@ BLE_PAWR_RESPONSE_SLOT_CHAR_UUID = b"\xCC\xCC"
 class PawrOpCodes(Enum):
     PING = 0
     READ_SENSOR_VALUES = 1
+    REASSIGN_RESPONSE_SLOT = 2
 
 class ConnectionStates(Enum):
     CONNECTING = 0
@@ -47,6 +48,7 @@ class ConnectionInfo():
         self.ble_address = ble_address
         self.subevent = None
         self.pawr_addr = None
+        self.new_tag = False
         self.service_handle = None
         self.char_handles = []
         self.state = None
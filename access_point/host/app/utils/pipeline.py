@@ -0,0 +1,60 @@
+import queue
+import threading
+
+
+class SpscRing():
+    """ Bounded single-producer/single-consumer ring buffer.
+
+    The producer only writes tail and the consumer only writes head, so neither side takes a lock to move data.
+    put() never blocks: when the ring is full the item is rejected and counted, and the producer decides how to back off.
+    get() mirrors queue.Queue.get() so the consumer can wait with a timeout.
+    """
+    def __init__(self, capacity):
+        self.capacity = capacity
+        self.buffer = [None] * capacity
+        self.head = 0  # Written by the consumer only
+        self.tail = 0  # Written by the producer only
+        self.not_empty = threading.Event()
+        self.pushed = 0
+        self.dropped = 0
+        self.high_watermark = 0
+
+    def __len__(self):
+        return self.tail - self.head
+
+    def free(self):
+        """ Number of items that can be put before the ring overflows. """
+        return self.capacity - (self.tail - self.head)
+
+    def put(self, item):
+        """ Append an item. Returns False, and counts the overflow, if the ring is full. """
+        used = self.tail - self.head
+        if used >= self.capacity:
+            self.dropped += 1
+            return False
+
+        self.buffer[self.tail % self.capacity] = item
+        self.tail += 1
+        self.pushed += 1
+        if used + 1 > self.high_watermark:
+            self.high_watermark = used + 1
+        self.not_empty.set()
+        return True
+
+    def get(self, timeout=None):
+        """ Remove and return the oldest item. Raises queue.Empty if nothing arrives within the timeout. """
+        while self.head == self.tail:
+            self.not_empty.clear()
+            if self.head != self.tail:  # The producer may have pushed between the check and the clear
+                break
+            if not self.not_empty.wait(timeout):
+                raise queue.Empty
+
+        index = self.head % self.capacity
+        item = self.buffer[index]
+        self.buffer[index] = None
+        self.head += 1
+        return item
+
+    def stats(self):
+        return f"{len(self)}/{self.capacity} queued, {self.pushed} pushed, {self.dropped} dropped, high watermark {self.high_watermark}"
@@ -2,11 +2,14 @@ import psycopg2
 import json
 
 
-def timescale_write(cursor, query):
-    cursor.execute(query)
+def timescale_write(cursor, query, params=None):
+    cursor.execute(query, params)
+
+def timescale_write_many(cursor, query, params_list):
+    cursor.executemany(query, params_list)
         
-def timescale_read(cursor, query):
-    cursor.execute(query)
+def timescale_read(cursor, query, params=None):
+    cursor.execute(query, params)
     return_val = cursor.fetchall()
 
     return return_val
\ No newline at end of file
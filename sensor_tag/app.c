@@ -130,11 +130,16 @@ void sl_bt_on_event(sl_bt_msg_t *evt)
 
                 if (subevent_opcode != IGNORE_MESSAGE) {
                     // Handle the messsage, and set the response
-                    pawr_data_handler(subevent_opcode, subevent_data_len, pawr_response_data, &pawr_response_data_len);
+                    pawr_data_handler(subevent_opcode, evt->data.evt_pawr_sync_subevent_report.data.data, subevent_data_len, pawr_response_data, &pawr_response_data_len);
                     sc = sl_bt_pawr_sync_set_response_data(evt->data.evt_pawr_sync_subevent_report.sync, evt->data.evt_pawr_sync_subevent_report.event_counter,
                                                         evt->data.evt_pawr_sync_subevent_report.subevent, evt->data.evt_pawr_sync_subevent_report.subevent, pawr_response_slot, pawr_response_data_len,
                                                         pawr_response_data);
                     app_assert_status(sc);
+
+                    // The reassign acknowledgement is sent from the old slot, the tag answers from the new one after that
+                    if (subevent_opcode == REASSIGN_RESPONSE_SLOT && pawr_response_data_len == 3) {
+                        pawr_response_slot = pawr_response_data[2];
+                    }
                 }
             }
             // Restart the timer as the tag is in sync
@@ -175,10 +180,10 @@ void pawr_set_new_state(app_state_t new_state)
 }
 
 /* Handle the incoming PAwR data */
-void pawr_data_handler(pawr_opcodes_t subevent_opcode, uint8_t data_len, uint8_t *response_data, uint8_t *response_data_len)
+void pawr_data_handler(pawr_opcodes_t subevent_opcode, uint8_t *data, uint8_t data_len, uint8_t *response_data, uint8_t *response_data_len)
 {
     sl_status_t sc;
-    (void)data_len;
+    uint8_t header_len = data[0];
     switch (subevent_opcode) {
         case PING:
             // When pinged, just reply with the tag address and ping opcode
@@ -205,6 +210,17 @@ void pawr_data_handler(pawr_opcodes_t subevent_opcode, uint8_t data_len, uint8_t
             memcpy(&response_data[2], pawr_sensor_data, pawr_sensor_data_len);
             *response_data_len = pawr_sensor_data_len + PAWR_HEADER_LEN;
             break;
+        case REASSIGN_RESPONSE_SLOT:
+            // Acknowledge with the new response slot, which follows the opcode
+            if (data_len < header_len + 3) {
+                *response_data_len = 0;
+                break;
+            }
+            response_data[0] = pawr_response_slot;
+            response_data[1] = REASSIGN_RESPONSE_SLOT;
+            response_data[2] = data[header_len + 2];
+            *response_data_len = 3;
+            break;
         default:
             break;
     }
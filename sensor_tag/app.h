@@ -24,7 +24,8 @@ typedef enum {
 
 typedef enum { 
     PING, 
-    READ_SENSOR_VALUES 
+    READ_SENSOR_VALUES,
+    REASSIGN_RESPONSE_SLOT
 } pawr_opcodes_t;
 
 typedef struct {
@@ -50,7 +51,7 @@ bool app_is_ok_to_sleep(void);
 void advertising_cb(sl_sleeptimer_timer_handle_t *sleeptimer_handle, void* data);
 
 /* Handle the incoming PAwR data */
-void pawr_data_handler(pawr_opcodes_t subevent_opcode, uint8_t data_len, uint8_t* response_data, uint8_t* response_data_len);
+void pawr_data_handler(pawr_opcodes_t subevent_opcode, uint8_t* data, uint8_t data_len, uint8_t* response_data, uint8_t* response_data_len);
 
 /* Check if the tag address (response slot) is in the header of the PAwR message. If address is found, return the data */
 uint8_t find_addr_in_payload(uint8_t* message);
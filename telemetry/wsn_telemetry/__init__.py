@@ -0,0 +1,89 @@
+"""
+MQTT telemetry format of the sensor network: encoded by the access point, decoded by its database client and by the
+web app's live feed. Both install this package, see their requirements.txt, so there is only one definition.
+"""
+
+import datetime
+import json
+import struct
+
+TELEMETRY_ENCODING_JSON = "json"
+TELEMETRY_ENCODING_PACKED = "packed"
+
+# Packed format: one header followed by a fixed-size little-endian record per reading.
+TELEMETRY_MAGIC = 0xA5
+TELEMETRY_VERSION = 2
+TELEMETRY_HEADER = struct.Struct("<BBH")       # magic, version, record count
+TELEMETRY_RECORD = struct.Struct("<6sqhHBbB")  # BLE address, epoch ms, temperature * 100, humidity * 100, battery level, RSSI, missed responses
+TELEMETRY_RECORD_V1 = struct.Struct("<6sqhHB") # Version 1 records have no link quality
+TELEMETRY_MAX_RECORDS = 0xFFFF
+
+
+def encode_json(reading):
+    """ Encode a single reading as the legacy JSON document. """
+    reading = dict(reading)
+    reading["timestamp"] = reading["timestamp"].isoformat()
+    return json.dumps(reading)
+
+def encode_packed(readings):
+    """ Encode a batch of readings as one packed message. """
+    if len(readings) > TELEMETRY_MAX_RECORDS:
+        raise ValueError(f"Too many readings for one packed message: {len(readings)}")
+
+    payload = bytearray(TELEMETRY_HEADER.size + TELEMETRY_RECORD.size * len(readings))
+    TELEMETRY_HEADER.pack_into(payload, 0, TELEMETRY_MAGIC, TELEMETRY_VERSION, len(readings))
+    offset = TELEMETRY_HEADER.size
+    for reading in readings:
+        TELEMETRY_RECORD.pack_into(payload, offset,
+                                   bytes.fromhex(reading["address"].replace(":", "")),
+                                   int(reading["timestamp"].timestamp() * 1000),
+                                   round(reading["temperature"] * 100),
+                                   round(reading["humidity"] * 100),
+                                   reading["battery_level"],
+                                   reading["rssi"],
+                                   min(reading["missed_responses"], 0xFF))
+        offset += TELEMETRY_RECORD.size
+
+    return bytes(payload)
+
+def decode(payload):
+    """ Decode a JSON or packed MQTT payload into a list of readings. """
+    if len(payload) > 0 and payload[0] == TELEMETRY_MAGIC:
+        return decode_packed(payload)
+
+    readings = json.loads(payload.decode("utf-8"))
+    if isinstance(readings, dict):
+        readings = [readings]
+    for reading in readings:
+        reading["address"] = reading["address"].lower()
+        reading["timestamp"] = datetime.datetime.fromisoformat(reading["timestamp"])
+        reading.setdefault("rssi", None)
+        reading.setdefault("missed_responses", None)
+    return readings
+
+def decode_packed(payload):
+    """ Decode a packed message into a list of readings. """
+    magic, version, count = TELEMETRY_HEADER.unpack_from(payload, 0)
+    if version == TELEMETRY_VERSION:
+        record = TELEMETRY_RECORD
+    elif version == 1:
+        record = TELEMETRY_RECORD_V1
+    else:
+        raise ValueError(f"Unsupported telemetry version {version}")
+    if len(payload) != TELEMETRY_HEADER.size + record.size * count:
+        raise ValueError(f"Packed telemetry length {len(payload)} does not match record count {count}")
+
+    readings = []
+    for address, timestamp_ms, temperature, humidity, battery_level, *link_quality in record.iter_unpack(payload[TELEMETRY_HEADER.size:]):
+        rssi, missed_responses = link_quality if link_quality else (None, None)
+        readings.append({
+            "address": address.hex(":"),
+            "timestamp": datetime.datetime.fromtimestamp(timestamp_ms / 1000, tz=datetime.timezone.utc),
+            "temperature": temperature / 100.0,
+            "humidity": humidity / 100.0,
+            "battery_level": battery_level,
+            "rssi": rssi,
+            "missed_responses": missed_responses,
+        })
+
+    return readings
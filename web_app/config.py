@@ -1,9 +1,27 @@
 WEB_APP_HOST = "localhost"
 WEB_APP_PORT = "5001"
+WEB_APP_DEBUG = False  # True runs the Flask development server with the reloader instead of waitress
+WEB_APP_THREADS = 32  # Worker threads of waitress. Requests are short, the live streams are served without a thread each.
+WEB_APP_CONNECTION_LIMIT = 200  # Connections accepted by waitress before new ones wait in the listen backlog
+WEB_APP_CHANNEL_TIMEOUT_S = 60  # Clients that send or receive nothing for this long are disconnected
+WEB_APP_STREAM_PORT = "5002"  # Server-Sent Events of the live readings, connected to by the browsers on the host of the page
+WEB_APP_STREAM_CONNECTION_LIMIT = 1000  # Open live streams, further ones are answered with 503
 
 # Timescaledb config
 TIMESCALE_USER = "secret"
 TIMESCALE_PASS = "secret"
 TIMESCALE_HOST = "192.168.0.102"
 TIMESCALE_PORT = "5432"
-TIMESCALE_DATABASE = "sensor_monitoring"
\ No newline at end of file
+TIMESCALE_DATABASE = "sensor_monitoring"
+
+# MQTT broker that the access point publishes the readings to
+MQTT_HOST = "localhost"
+MQTT_PORT = 1883
+MQTT_TOPIC = "sensor_data"
+
+# Connections kept open to Timescale by each web app process. Requests wait for a free one when all are in use.
+TIMESCALE_POOL_MIN_CONNECTIONS = 1
+TIMESCALE_POOL_MAX_CONNECTIONS = 16
+TIMESCALE_STATEMENT_TIMEOUT_MS = 10000  # Queries that take longer are cancelled and answered with 503
+TIMESCALE_IDLE_TIMEOUT_MS = 60000  # Exports whose client stops reading are ended after this long
+TIMESCALE_EXPORT_STATEMENT_TIMEOUT_MS = 0  # Statement timeout of exports, 0 for none. A large export may fetch for long.
@@ -0,0 +1,145 @@
+"""
+Load test of the web app: a number of simulated dashboards that each keep a live stream open like sensors.html does,
+and load the other views now and then. Prints the latency percentiles per path, the time until each stream was
+accepted, and the age of the live readings when they arrived (the time since the reading was taken, so it includes
+the delay of the access point and the broker).
+
+Run against a running web app: python3 tools/load_test.py --url http://localhost:5001 --stream-url http://localhost:5002/stream --clients 50 --duration 60
+"""
+
+import argparse
+import collections
+import datetime
+import http.client
+import json
+import random
+import socket
+import threading
+import time
+import urllib.parse
+
+VIEW_INTERVAL_S = 5.0  # Mean time between two views of a dashboard
+DEFAULT_VIEW_PATHS = ["/sensors/", "/sites/summary", "/sensors/S1?hours=24", "/sensors/S2?hours=200&format=binary"]
+
+
+class Stream(threading.Thread):
+    """ One Server-Sent Events connection, read until the deadline. """
+    def __init__(self, url, deadline, results, lock):
+        super().__init__(daemon=True)
+        self.url = url
+        self.deadline = deadline
+        self.results = results
+        self.lock = lock
+
+    def record(self, key, value):
+        with self.lock:
+            self.results[key].append(value)
+
+    def run(self):
+        start = time.perf_counter()
+        try:
+            connection = socket.create_connection((self.url.hostname, self.url.port or 80), timeout=30)
+            connection.sendall(f"GET {self.url.path or '/'} HTTP/1.1\r\nHost: {self.url.netloc}\r\n"
+                               f"Accept: text/event-stream\r\n\r\n".encode())
+            stream = connection.makefile("rb")
+            status = stream.readline().split(b" ")[1]
+            while stream.readline() not in (b"\r\n", b""):
+                pass
+        except (OSError, IndexError):
+            self.record("stream connect", None)
+            return
+        self.record("stream connect", time.perf_counter() - start if status == b"200" else None)
+        if status != b"200":
+            return
+
+        connection.settimeout(max(self.deadline - time.monotonic(), 0.1))  # A file of the socket cannot be read after a timeout
+        event = None
+        while time.monotonic() < self.deadline:
+            try:
+                line = stream.readline()
+            except socket.timeout:
+                break
+            except OSError:
+                self.record("stream connect", None)  # Dropped by the server
+                break
+            if line == b"":
+                break
+            if line.startswith(b"event: "):
+                event = line[7:].strip()
+            elif line.startswith(b"data: ") and event == b"reading":
+                timestamp = datetime.datetime.fromisoformat(json.loads(line[6:])["timestamp"])
+                self.record("reading age", (datetime.datetime.now(datetime.timezone.utc) - timestamp).total_seconds())
+            elif line == b"\n":
+                event = None
+        connection.close()
+
+
+class Dashboard(threading.Thread):
+    def __init__(self, url, view_paths, deadline, results, lock):
+        super().__init__(daemon=True)
+        self.url = url
+        self.view_paths = view_paths
+        self.deadline = deadline
+        self.results = results
+        self.lock = lock
+
+    def request(self, connection, path):
+        start = time.perf_counter()
+        try:
+            connection.request("GET", path)
+            response = connection.getresponse()
+            response.read()
+            status = response.status
+        except (OSError, http.client.HTTPException):
+            connection.close()  # Reconnects on the next request
+            status = None
+        elapsed_s = time.perf_counter() - start
+        key = path.split("?")[0]
+        with self.lock:
+            self.results[key].append(elapsed_s if status == 200 else None)
+
+    def run(self):
+        connection = http.client.HTTPConnection(self.url.hostname, self.url.port or 80, timeout=30)
+        time.sleep(random.uniform(0, VIEW_INTERVAL_S))  # Spread the clients over the interval
+        while time.monotonic() < self.deadline:
+            self.request(connection, random.choice(self.view_paths))
+            time.sleep(random.expovariate(1 / VIEW_INTERVAL_S))
+        connection.close()
+
+
+def percentile(sorted_values, p):
+    return sorted_values[min(len(sorted_values) - 1, int(len(sorted_values) * p / 100))]
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--url", default="http://localhost:5001", help="Web app to test")
+    parser.add_argument("--stream-url", default="http://localhost:5002/stream", help="Live stream of the web app")
+    parser.add_argument("--clients", type=int, default=50, help="Simulated dashboards")
+    parser.add_argument("--duration", type=float, default=60.0, help="Seconds to run")
+    parser.add_argument("--paths", nargs="*", default=DEFAULT_VIEW_PATHS, help="Other paths a dashboard asks for")
+    args = parser.parse_args()
+
+    results = collections.defaultdict(list)  # path -> latency in seconds, None for a failed request
+    lock = threading.Lock()
+    deadline = time.monotonic() + args.duration
+    threads = [Stream(urllib.parse.urlsplit(args.stream_url), deadline, results, lock) for _ in range(args.clients)]
+    threads += [Dashboard(urllib.parse.urlsplit(args.url), args.paths, deadline, results, lock) for _ in range(args.clients)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+
+    print(f"{args.clients} clients for {args.duration:.0f} s against {args.url}")
+    print(f"{'path':<20}  {'requests':>8}  {'errors':>6}  {'p50 ms':>8}  {'p99 ms':>8}  {'max ms':>8}")
+    for path, latencies in sorted(results.items()):
+        ok = sorted(latency for latency in latencies if latency != None)
+        errors = len(latencies) - len(ok)
+        if not ok:
+            print(f"{path:<20}  {len(latencies):>8}  {errors:>6}")
+            continue
+        print(f"{path:<20}  {len(latencies):>8}  {errors:>6}  {percentile(ok, 50) * 1000:>8.1f}  "
+              f"{percentile(ok, 99) * 1000:>8.1f}  {ok[-1] * 1000:>8.1f}")
+
+
+if __name__ == "__main__":
+    main()
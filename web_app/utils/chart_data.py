@@ -0,0 +1,24 @@
+import struct
+import sys
+from array import array
+
+CHART_DATA_MIMETYPE = "application/octet-stream"
+
+# Binary chart data: a header followed by one little-endian column per series, so that the browser can view each
+# column as a typed array without parsing. The header is padded to 8 bytes to keep the int64 column aligned.
+CHART_DATA_HEADER = struct.Struct("<II")  # point count, reserved
+
+
+def encode_chart_data(timestamps, temp_measurements, hum_measurements):
+    """ Encode a chart as the header, int64 epoch ms timestamps, and float32 temperature and humidity columns.
+    Missing values are sent as NaN. """
+    columns = [
+        array("q", [int(timestamp.timestamp() * 1000) for timestamp in timestamps]),
+        array("f", [float("nan") if value == None else value for value in temp_measurements]),
+        array("f", [float("nan") if value == None else value for value in hum_measurements]),
+    ]
+    if sys.byteorder != "little":
+        for column in columns:
+            column.byteswap()
+
+    return CHART_DATA_HEADER.pack(len(timestamps), 0) + b"".join(column.tobytes() for column in columns)
@@ -0,0 +1,97 @@
+def lttb(xs, ys, threshold):
+    """ Largest-Triangle-Three-Buckets downsampling. Returns the indices of the points to keep, in order.
+
+    The first and last points are always kept. The points in between are split into threshold - 2 buckets, and from
+    each bucket the point that forms the largest triangle with the previously kept point and the average of the next
+    bucket is kept.
+    """
+    n = len(xs)
+    if threshold >= n or threshold < 3:
+        return list(range(n))
+
+    indices = [0]
+    bucket_size = (n - 2) / (threshold - 2)
+    a = 0
+    for i in range(threshold - 2):
+        start = int(i * bucket_size) + 1
+        end = int((i + 1) * bucket_size) + 1
+        next_start = end
+        next_end = min(int((i + 2) * bucket_size) + 1, n)
+
+        # Average of the next bucket. The last bucket is followed by the last point.
+        if next_start >= n - 1:
+            avg_x, avg_y = xs[n - 1], ys[n - 1]
+        else:
+            count = next_end - next_start
+            avg_x = sum(xs[next_start:next_end]) / count
+            avg_y = sum(ys[next_start:next_end]) / count
+
+        ax, ay = xs[a], ys[a]
+        max_area = -1.0
+        for j in range(start, end):
+            area = abs((ax - avg_x) * (ys[j] - ay) - (ax - xs[j]) * (avg_y - ay))
+            if area > max_area:
+                max_area = area
+                a_next = j
+        indices.append(a_next)
+        a = a_next
+
+    indices.append(n - 1)
+    return indices
+
+def split_at_gaps(xs, ys, budget):
+    """ Split the indices of the values that are not None into runs at the widest gaps, for a budget of budget points.
+
+    Every gap that is kept costs at least three points: the ends of the runs on both sides and the missing value that
+    marks it. At most half of the budget is spent on gaps, narrower ones are bridged, so that the shape of the series
+    still gets points. Returns the runs as lists of indices, and the gaps as the index of their first missing value. """
+    values = [i for i, y in enumerate(ys) if y != None]
+    gaps = [(xs[values[k + 1]] - xs[values[k]], k) for k in range(len(values) - 1) if values[k + 1] > values[k] + 1]
+    gaps = sorted(k for _, k in sorted(gaps, reverse=True)[:max(0, (budget // 2 - 2) // 3)])
+    runs = []
+    start = 0
+    for k in gaps:
+        runs.append(values[start:k + 1])
+        start = k + 1
+    if start < len(values):
+        runs.append(values[start:])
+    return runs, [values[k] + 1 for k in gaps]
+
+def downsample_one(xs, ys, budget):
+    """ Indices of at most budget points of one series, which may have missing values. """
+    runs, gap_markers = split_at_gaps(xs, ys, budget)
+    if not runs or budget < 2:
+        return [run[0] for run in runs][:max(budget, 0)]
+
+    # Every run keeps its ends, the rest of the budget is shared in proportion to the length of the runs
+    available = budget - len(gap_markers)
+    shares = [min(len(run), 2) for run in runs]
+    extra = available - sum(shares)
+    values = sum(len(run) for run in runs)
+    kept = list(gap_markers)
+    for run, share in zip(runs, shares):
+        share += extra * len(run) // values
+        if share >= len(run):
+            kept.extend(run)
+        elif share >= 3:
+            kept.extend(run[i] for i in lttb([xs[i] for i in run], [ys[i] for i in run], share))
+        else:
+            kept.extend((run[0], run[-1]))
+    return kept
+
+def downsample_series(timestamps, series, max_points):
+    """ Downsample several series that share timestamps to at most max_points points.
+    Each series gets an equal share of the points, and the union of the kept indices is returned.
+
+    Missing values split a series into runs that are downsampled separately. The first missing value after a run is
+    kept, so that the gap still shows in the chart. When there are more gaps than the points allow, only the widest
+    ones are kept and the others are bridged, see split_at_gaps(). """
+    if len(timestamps) <= max_points or not series:
+        return list(range(len(timestamps)))
+
+    xs = [timestamp.timestamp() for timestamp in timestamps]
+    budget = max_points // len(series)
+    kept = set()
+    for ys in series:
+        kept.update(downsample_one(xs, ys, budget))
+    return sorted(kept)
@@ -0,0 +1,69 @@
+import csv
+import io
+
+try:
+    import pyarrow
+    import pyarrow.parquet
+    PARQUET_AVAILABLE = True
+except ImportError:
+    PARQUET_AVAILABLE = False
+
+CSV_MIMETYPE = "text/csv"
+PARQUET_MIMETYPE = "application/vnd.apache.parquet"
+
+
+def export_csv(chunks, columns):
+    """ Encode chunks of rows as CSV, yielding one piece of text per chunk. Times are written in ISO 8601. """
+    buffer = io.StringIO()
+    writer = csv.writer(buffer)
+    writer.writerow(columns)
+    for rows in chunks:
+        writer.writerows((row[0].isoformat(), *row[1:]) for row in rows)
+        yield buffer.getvalue()
+        buffer.seek(0)
+        buffer.truncate(0)
+    if buffer.tell() > 0:
+        yield buffer.getvalue()  # Header of an empty export
+
+
+class ChunkSink(io.RawIOBase):
+    """ Write-only file that hands out what has been written since the last take().
+    tell() keeps counting across takes, as the Parquet writer records the offsets of the row groups. """
+    def __init__(self):
+        self.chunks = []
+        self.position = 0
+
+    def writable(self):
+        return True
+
+    def write(self, data):
+        self.chunks.append(bytes(data))
+        self.position += len(data)
+        return len(data)
+
+    def tell(self):
+        return self.position
+
+    def take(self):
+        data = b"".join(self.chunks)
+        self.chunks = []
+        return data
+
+
+def export_parquet(chunks, columns):
+    """ Encode chunks of rows as a Parquet file with one row group per chunk, yielding the bytes as they are written.
+    The first column is the time, the second the sensor_id, and the rest are measurements. """
+    schema = pyarrow.schema(
+        [(columns[0], pyarrow.timestamp("us", tz="UTC")), (columns[1], pyarrow.string())]
+        + [(column, pyarrow.float64()) for column in columns[2:]])
+    sink = ChunkSink()
+    writer = pyarrow.parquet.ParquetWriter(sink, schema)
+    try:
+        for rows in chunks:
+            table = pyarrow.Table.from_arrays(
+                [pyarrow.array(values, type=field.type) for values, field in zip(zip(*rows), schema)], schema=schema)
+            writer.write_table(table)
+            yield sink.take()
+    finally:
+        writer.close()
+    yield sink.take()  # Footer
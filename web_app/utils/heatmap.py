@@ -0,0 +1,124 @@
+import datetime
+import threading
+from utils.timescale import get_site_bucket, SENSOR_DATA_AGGREGATES
+
+HEATMAP_RESOLUTION = 24  # Grid cells along each axis
+HEATMAP_IDW_POWER = 2
+HEATMAP_HISTORY_CACHE_SIZE = 256  # Number of (site, bucket) grids kept for the time slider
+HEATMAP_HISTORY_VIEW = "sensor_data_15m"
+
+
+def idw_grid(samples, resolution=HEATMAP_RESOLUTION, power=HEATMAP_IDW_POWER):
+    """ Inverse distance weighted interpolation of samples (north, east, value) over their bounding box.
+    Returns the north and east coordinates of the grid and the values as rows of north, columns of east. """
+    norths = [sample[0] for sample in samples]
+    easts = [sample[1] for sample in samples]
+    north_min, north_max = min(norths), max(norths)
+    east_min, east_max = min(easts), max(easts)
+    if north_min == north_max:
+        north_min, north_max = north_min - 1, north_max + 1
+    if east_min == east_max:
+        east_min, east_max = east_min - 1, east_max + 1
+
+    grid_north = [north_min + (north_max - north_min) * i / (resolution - 1) for i in range(resolution)]
+    grid_east = [east_min + (east_max - east_min) * i / (resolution - 1) for i in range(resolution)]
+    grid = []
+    for north in grid_north:
+        row = []
+        for east in grid_east:
+            weight_sum = 0.0
+            value_sum = 0.0
+            for sample_north, sample_east, value in samples:
+                distance_sq = (north - sample_north) ** 2 + (east - sample_east) ** 2
+                if distance_sq == 0:
+                    weight_sum, value_sum = 1.0, value
+                    break
+                weight = distance_sq ** (-power / 2)
+                weight_sum += weight
+                value_sum += weight * value
+            row.append(round(value_sum / weight_sum, 2))
+        grid.append(row)
+    return grid_north, grid_east, grid
+
+def build_heatmap(site_id, sensors, timestamp):
+    """ Heatmap response for sensors as {sensor_id: (north, east, temperature, humidity)}. """
+    sensors = {sensor_id: values for sensor_id, values in sensors.items()
+               if None not in values}
+    heatmap = {"site_id": site_id, "timestamp": timestamp, "sensors": [
+        {"sensor_id": sensor_id, "north": north, "east": east, "temperature": temperature, "humidity": humidity}
+        for sensor_id, (north, east, temperature, humidity) in sorted(sensors.items())
+    ]}
+    if not sensors:
+        return heatmap
+
+    samples = list(sensors.values())
+    heatmap["north"], heatmap["east"], heatmap["temperature"] = idw_grid([(north, east, temperature) for north, east, temperature, _ in samples])
+    _, _, heatmap["humidity"] = idw_grid([(north, east, humidity) for north, east, _, humidity in samples])
+    return heatmap
+
+
+class HeatmapCache():
+    """ Interpolated grids per site, computed at most once per new reading.
+
+    The latest values come from the shared LatestReadings store, which the live feed keeps up to date. A grid is cached
+    with the version of its site and only recomputed by the first request after a reading of the site has changed, no
+    matter how many dashboards poll it. The interpolation runs outside the store lock, so readings keep flowing while a
+    grid is computed. Grids of past buckets for the time slider never change, so they are cached until evicted.
+    """
+    def __init__(self, latest):
+        self.latest = latest
+        self.lock = threading.Lock()
+        self.compute_lock = threading.Lock()  # Concurrent requests for a changed grid wait for one computation
+        self.grids = {}  # site_id -> (site version, heatmap)
+        self.history = {}  # (site_id, bucket) -> heatmap
+        self.computations = 0
+
+    def get_latest(self, site_id):
+        """ Heatmap of the latest readings, or None if the site does not exist. """
+        version = self.latest.site_version(site_id)
+        if version == None:
+            return None
+        with self.lock:
+            cached = self.grids.get(site_id)
+        if cached != None and cached[0] == version:
+            return cached[1]
+
+        with self.compute_lock:
+            with self.lock:
+                cached = self.grids.get(site_id)
+            snapshot = self.latest.site_snapshot(site_id)
+            if snapshot == None:
+                return None
+            version, sensors, latest_time = snapshot
+            if cached != None and cached[0] == version:
+                return cached[1]
+            heatmap = build_heatmap(site_id, sensors, latest_time.isoformat() if latest_time != None else None)
+            with self.lock:
+                self.grids[site_id] = (version, heatmap)
+                self.computations += 1
+        return heatmap
+
+    def get_at(self, site_id, at):
+        """ Heatmap of the aggregate bucket containing the datetime at, or None if the site does not exist. The still
+        open bucket is not cached. """
+        if self.latest.site_version(site_id) == None:
+            return None
+        bucket_s = next(bucket_s for bucket_s, view, _ in SENSOR_DATA_AGGREGATES if view == HEATMAP_HISTORY_VIEW)
+        bucket = datetime.datetime.fromtimestamp(int(at.timestamp()) // bucket_s * bucket_s, tz=datetime.timezone.utc)
+        key = (site_id, bucket)
+        with self.lock:
+            heatmap = self.history.get(key)
+        if heatmap != None:
+            return heatmap
+
+        sensors = {sensor_id: (north, east, temperature, humidity)
+                   for sensor_id, north, east, temperature, humidity in get_site_bucket(site_id, HEATMAP_HISTORY_VIEW, bucket)}
+        heatmap = build_heatmap(site_id, sensors, bucket.isoformat())
+        with self.lock:
+            self.computations += 1
+        if bucket + datetime.timedelta(seconds=bucket_s) < datetime.datetime.now(datetime.timezone.utc):
+            with self.lock:
+                if len(self.history) >= HEATMAP_HISTORY_CACHE_SIZE:
+                    self.history.pop(next(iter(self.history)))  # Evict the oldest entry
+                self.history[key] = heatmap
+        return heatmap
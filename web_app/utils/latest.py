@@ -0,0 +1,171 @@
+import datetime
+import threading
+import time
+from utils.live import parse_event_time
+from utils.site_summary import SiteSummary
+from utils.timescale import get_latest_readings
+
+LATEST_MAX_AGE_S = 300  # Full reload, to pick up sites and sensors that were added or moved without sending a reading
+
+
+class SensorLatest():
+    """ Metadata, latest reading and battery level of one sensor. """
+    __slots__ = ("site_id", "model", "north", "east", "ble_addr", "temperature", "humidity", "time", "battery_level",
+                 "last_seen")
+
+    def __init__(self, site_id, model, north, east, ble_addr, temperature, humidity, time, battery_level, last_seen):
+        self.site_id = site_id
+        self.model = model
+        self.north = north
+        self.east = east
+        self.ble_addr = ble_addr
+        self.temperature = temperature
+        self.humidity = humidity
+        self.time = time
+        self.battery_level = battery_level
+        self.last_seen = last_seen  # Newest of the reading and status times
+
+
+class LatestReadings():
+    """ Latest reading of every sensor, grouped by site, shared by the views that show the current state: the site
+    summaries, the heatmaps and the sensors table.
+
+    The store is loaded from the database with one query, outside the lock, and then kept up to date by the live feed.
+    Readings that arrive while the query runs are applied on top of its result. Every change of a site bumps its
+    version, so that views derived from it know when to recompute, and updates the summary statistics of the site in
+    O(1), so that they never disagree with the readings. The store is reloaded when a reading arrives from
+    an unknown sensor, and every LATEST_MAX_AGE_S.
+    """
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.load_lock = threading.Lock()  # Only one thread queries, the others wait for its result
+        self.sensors = None  # sensor_id -> SensorLatest, None until loaded
+        self.site_sensors = {}  # site_id -> sensor_ids
+        self.site_versions = {}  # site_id -> number of changes since the load
+        self.summaries = {}  # site_id -> SiteSummary
+        self.generation = 0  # Number of loads
+        self.loaded_at = None
+        self.recent = None  # sensor_id -> newest event received during a load
+        self.hits = 0  # Requests served from memory
+        self.misses = 0  # Requests that waited for a load
+
+    def is_fresh(self):
+        return self.loaded_at != None and time.monotonic() - self.loaded_at < LATEST_MAX_AGE_S
+
+    def refresh(self):
+        """ Load the store if it has not been loaded, or is due for a reload. """
+        with self.lock:
+            if self.is_fresh():
+                self.hits += 1
+                return
+            self.misses += 1
+        with self.load_lock:
+            with self.lock:
+                if self.is_fresh():
+                    return
+                self.recent = {}
+
+            try:
+                rows = get_latest_readings()
+            except Exception:
+                with self.lock:
+                    self.recent = None
+                raise
+
+            sensors = {}
+            site_sensors = {}
+            summaries = {}
+            for (site_id, sensor_id, model, north, east, ble_addr, temperature, humidity, reading_time, battery_level,
+                 status_time) in rows:
+                if site_id not in summaries:
+                    site_sensors[site_id] = []
+                    summaries[site_id] = SiteSummary(site_id)
+                if sensor_id != None:
+                    last_seen = max(filter(None, (reading_time, status_time)), default=None)
+                    sensors[sensor_id] = SensorLatest(site_id, model, north, east, ble_addr, temperature, humidity,
+                                                      reading_time, battery_level, last_seen)
+                    site_sensors[site_id].append(sensor_id)
+                    summaries[site_id].update(sensor_id, temperature, humidity, battery_level)
+
+            with self.lock:
+                self.sensors = sensors
+                self.site_sensors = site_sensors
+                self.site_versions = dict.fromkeys(site_sensors, 0)
+                self.summaries = summaries
+                self.generation += 1
+                self.loaded_at = time.monotonic()
+                recent, self.recent = self.recent, None
+                for event in recent.values():
+                    self.apply(event)
+
+    def on_reading(self, event):
+        """ Live feed listener. """
+        event = dict(event, timestamp=parse_event_time(event["timestamp"]))
+        with self.lock:
+            if self.recent != None:
+                previous = self.recent.get(event["sensor_id"])
+                if previous == None or previous["timestamp"] < event["timestamp"]:
+                    self.recent[event["sensor_id"]] = event
+            if self.sensors != None:
+                self.apply(event)
+
+    def apply(self, event):
+        sensor = self.sensors.get(event["sensor_id"])
+        if sensor == None:
+            self.loaded_at = None  # New sensor, reload on the next request
+            return
+        if sensor.time != None and sensor.time > event["timestamp"]:
+            return  # Late reading
+        sensor.temperature = event["temperature"]
+        sensor.humidity = event["humidity"]
+        sensor.time = event["timestamp"]
+        if event["battery_level"] != None:
+            sensor.battery_level = event["battery_level"]
+        sensor.last_seen = max(sensor.last_seen or event["timestamp"], event["timestamp"])
+        self.summaries[sensor.site_id].update(event["sensor_id"], sensor.temperature, sensor.humidity, sensor.battery_level)
+        self.site_versions[sensor.site_id] += 1
+
+    def site_version(self, site_id):
+        """ Key that changes whenever a reading of the site changes. None if the site does not exist. """
+        self.refresh()
+        with self.lock:
+            if site_id not in self.site_sensors:
+                return None
+            return (self.generation, self.site_versions[site_id])
+
+    def site_snapshot(self, site_id):
+        """ Returns (version, {sensor_id: (north, east, temperature, humidity)}, newest reading time), or None if the
+        site does not exist. """
+        self.refresh()
+        with self.lock:
+            if site_id not in self.site_sensors:
+                return None
+            sensors = {}
+            latest_time = None
+            for sensor_id in self.site_sensors[site_id]:
+                sensor = self.sensors[sensor_id]
+                sensors[sensor_id] = (sensor.north, sensor.east, sensor.temperature, sensor.humidity)
+                if sensor.time != None and (latest_time == None or sensor.time > latest_time):
+                    latest_time = sensor.time
+            return (self.generation, self.site_versions[site_id]), sensors, latest_time
+
+    def site_summaries(self):
+        """ Summary of every site, ordered by site_id. """
+        self.refresh()
+        now = datetime.datetime.now(datetime.timezone.utc)
+        with self.lock:
+            return [self.summaries[site_id].to_dict(now, [self.sensors[sensor_id].last_seen for sensor_id in self.site_sensors[site_id]])
+                    for site_id in sorted(self.summaries)]
+
+    def sensor_list(self):
+        """ Every sensor as (sensor_id, site_id, sensor_model, location_north, location_east, ble_addr, battery_level,
+        last_seen), ordered by sensor_id, like get_sensors(). """
+        self.refresh()
+        with self.lock:
+            return [(sensor_id, sensor.site_id, sensor.model, sensor.north, sensor.east, sensor.ble_addr,
+                     sensor.battery_level, sensor.last_seen) for sensor_id, sensor in sorted(self.sensors.items())]
+
+    def stats(self):
+        with self.lock:
+            return {"hits": self.hits, "misses": self.misses, "loads": self.generation,
+                    "sensors": len(self.sensors) if self.sensors != None else None}
@@ -0,0 +1,128 @@
+import collections
+import datetime
+import itertools
+import logging
+import threading
+import time
+import paho.mqtt.client as mqtt
+from wsn_telemetry import decode
+from utils.timescale import get_sensors
+
+LIVE_EVENT_BUFFER_SIZE = 4096  # Recent readings kept for the streams, and for the dashboards that reconnect
+LIVE_UNKNOWN_SENSOR_RETRY_S = 60  # How long an address that is not in the sensors table is ignored before it is looked up again
+
+
+def as_utc(timestamp):
+    """ Timestamps without a UTC offset, e.g. from access points that publish naive JSON times, are taken as UTC. """
+    if timestamp.tzinfo == None:
+        return timestamp.replace(tzinfo=datetime.timezone.utc)
+    return timestamp
+
+def parse_event_time(value):
+    """ Datetime of the timestamp of a live feed event. """
+    return as_utc(datetime.datetime.fromisoformat(value))
+
+class LiveFeed():
+    """ One MQTT subscription shared by the whole Flask process.
+
+    Every reading is converted to an event, numbered into a buffer of recent events, and passed to the in-process
+    listeners. The live streams send the events after the last one each dashboard has seen from the buffer. The
+    database is not touched, except to map an unknown BLE address to its sensor_id.
+    """
+    def __init__(self, mqtt_host, mqtt_port, mqtt_topic):
+        self.logger = logging.getLogger(__name__)
+        self.host = mqtt_host
+        self.port = mqtt_port
+        self.topic = mqtt_topic
+        self.lock = threading.Lock()
+        self.started = False
+        self.client = None
+        self.listeners = []
+        self.sensor_ids = {}  # BLE address -> sensor_id
+        self.unknown_addresses = {}  # BLE address -> time.monotonic() of the lookup that did not find it
+        self.events = collections.deque(maxlen=LIVE_EVENT_BUFFER_SIZE)
+        self.seq = 0  # Number of the newest event
+
+    def start(self):
+        """ Connect to the broker. Started on first use, so the reloader's parent process does not subscribe too. """
+        with self.lock:
+            if self.started:
+                return
+            self.started = True
+        self.client = mqtt.Client()
+        self.client.on_connect = self.on_connect
+        self.client.on_message = self.on_message
+        self.client.connect_async(self.host, self.port)
+        self.client.loop_start()
+
+    def on_connect(self, client, userdata, flags, reason_code, properties=None):
+        if reason_code:
+            self.logger.error(f"Live feed failed to connect: {reason_code}")
+            return
+        # Subscribe to the legacy topic and the per-site topics
+        client.subscribe([(self.topic, 0), (f"{self.topic}/+", 0)])
+        self.logger.info(f"Live feed subscribed to {self.topic} at {self.host}:{self.port}")
+
+    def on_message(self, client, userdata, message):
+        try:
+            readings = decode(message.payload)
+        except Exception as e:
+            self.logger.error(f"Live feed failed to decode message on topic {message.topic}: {e}")
+            return
+
+        for reading in readings:
+            sensor_id = self.get_sensor_id(reading["address"])
+            if sensor_id == None:
+                continue
+            event = {
+                "sensor_id": sensor_id,
+                "timestamp": as_utc(reading["timestamp"]).isoformat(),
+                "temperature": reading["temperature"],
+                "humidity": reading["humidity"],
+                "battery_level": reading["battery_level"],
+            }
+            self.publish(event)
+            for listener in self.listeners:
+                listener(event)
+
+    def get_sensor_id(self, address):
+        """ Map a BLE address to its sensor_id, or None if it is not in the sensors table. The sensors are re-read for
+        an unknown address at most every LIVE_UNKNOWN_SENSOR_RETRY_S, so a sensor that is added after its first
+        reading shows up without a restart. """
+        sensor_id = self.sensor_ids.get(address)
+        if sensor_id != None:
+            return sensor_id
+        now = time.monotonic()
+        looked_up = self.unknown_addresses.get(address)
+        if looked_up != None and now - looked_up < LIVE_UNKNOWN_SENSOR_RETRY_S:
+            return None
+        self.sensor_ids = {sensor[5]: sensor[0] for sensor in get_sensors()}
+        self.unknown_addresses = {unknown: at for unknown, at in self.unknown_addresses.items()
+                                  if unknown not in self.sensor_ids and now - at < LIVE_UNKNOWN_SENSOR_RETRY_S}
+        if address not in self.sensor_ids:
+            self.unknown_addresses[address] = now
+        return self.sensor_ids.get(address)
+
+    def add_listener(self, listener):
+        """ Call listener(event) from the MQTT thread for every new reading, after it has been buffered. """
+        self.listeners.append(listener)
+
+    def publish(self, event):
+        with self.lock:
+            self.seq += 1
+            self.events.append(event)
+
+    def events_after(self, after):
+        """ Returns (seq, events, complete): the number of the newest event, the events newer than after, and False if
+        some of them have already left the buffer. Without after only the newest number is returned, as the starting
+        point of a stream. """
+        self.start()
+        with self.lock:
+            if after == None or after == self.seq:
+                return self.seq, [], True
+            if after > self.seq:
+                return self.seq, [], False  # The numbering restarted with the process
+            missed = self.seq - max(after, 0)
+            if missed > len(self.events):
+                return self.seq, list(self.events), False
+            return self.seq, list(itertools.islice(self.events, len(self.events) - missed, None)), True
@@ -0,0 +1,148 @@
+import asyncio
+import json
+import logging
+import threading
+
+LIVE_STREAM_KEEPALIVE_S = 15  # Comment line sent to idle streams so proxies keep the connection open
+LIVE_STREAM_RETRY_MS = 2000  # Reconnect delay the browsers are told to use
+LIVE_STREAM_REQUEST_TIMEOUT_S = 10  # Connections that have not sent their request headers by then are closed
+LIVE_STREAM_WRITE_TIMEOUT_S = 60  # Streams whose client has not read for this long are closed, it resumes on reconnect
+
+LIVE_STREAM_HEADERS = (b"HTTP/1.1 200 OK\r\n"
+                       b"Content-Type: text/event-stream\r\n"
+                       b"Cache-Control: no-cache\r\n"
+                       b"Access-Control-Allow-Origin: *\r\n"  # The page is served from the port of the web app
+                       b"X-Accel-Buffering: no\r\n"
+                       b"Connection: close\r\n\r\n")
+
+
+def parse_request(data):
+    """ Method, target and headers (lower case names) of the head of an HTTP request. """
+    lines = data.decode("latin-1").split("\r\n")
+    method, target = (lines[0].split(" ") + ["", ""])[:2]
+    headers = {}
+    for line in lines[1:]:
+        name, separator, value = line.partition(":")
+        if separator:
+            headers[name.strip().lower()] = value.strip()
+    return method, target, headers
+
+def format_event(seq, event):
+    return f"id: {seq}\nevent: reading\ndata: {json.dumps(event)}\n\n".encode()
+
+
+class LiveStreamServer():
+    """ Server-Sent Events with every new reading of the live feed, served on their own port.
+
+    waitress answers every request on one of its worker threads until the response ends, so a stream served by it
+    would hold a thread for as long as its dashboard is open. Here all streams are coroutines of one asyncio loop in a
+    background thread, and an open stream costs a socket, not a thread. Every new reading wakes the streams, which send
+    the events they have not seen yet from the buffer of the live feed. The event ids are the seq numbers of the
+    feed, so a browser that reconnects is sent what it missed, or a reset event if that has left the buffer.
+    """
+    def __init__(self, live_feed, host, port, connection_limit):
+        self.logger = logging.getLogger(__name__)
+        self.live_feed = live_feed
+        self.host = host
+        self.port = int(port)
+        self.connection_limit = connection_limit
+        self.lock = threading.Lock()
+        self.started = False
+        self.loop = None
+        self.new_events = None  # asyncio.Event, set and replaced for every new reading
+        self.streams = 0  # Open streams
+        self.connections = 0  # Accepted connections since the start
+        self.rejected = 0  # Connections refused because of the connection limit
+        self.timeouts = 0  # Streams closed because their client stopped reading
+        live_feed.add_listener(self.on_reading)
+
+    def start(self):
+        """ Start the server thread, and wait until it listens. Started on first use, like the live feed. """
+        with self.lock:
+            if self.started:
+                return
+            self.started = True
+        listening = threading.Event()
+        threading.Thread(target=asyncio.run, args=(self.serve(listening),), name="live-stream", daemon=True).start()
+        listening.wait()
+
+    async def serve(self, listening):
+        self.loop = asyncio.get_running_loop()
+        self.new_events = asyncio.Event()
+        try:
+            server = await asyncio.start_server(self.handle, self.host, self.port)
+        except OSError as e:
+            self.logger.error(f"Live stream failed to listen on {self.host}:{self.port}: {e}")
+            return
+        finally:
+            listening.set()
+        self.logger.info(f"Live stream listening on {self.host}:{self.port}")
+        async with server:
+            await server.serve_forever()
+
+    def on_reading(self, event):
+        """ Live feed listener, called from the MQTT thread after the event has been buffered. """
+        if self.loop != None:
+            self.loop.call_soon_threadsafe(self.wake)
+
+    def wake(self):
+        self.new_events.set()
+        self.new_events = asyncio.Event()
+
+    async def handle(self, reader, writer):
+        self.connections += 1
+        try:
+            try:
+                head = await asyncio.wait_for(reader.readuntil(b"\r\n\r\n"), LIVE_STREAM_REQUEST_TIMEOUT_S)
+            except (asyncio.TimeoutError, asyncio.IncompleteReadError, asyncio.LimitOverrunError):
+                return
+            method, target, headers = parse_request(head)
+            if method != "GET" or target.partition("?")[0] != "/stream":
+                writer.write(b"HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n")
+                return
+            if self.streams >= self.connection_limit:
+                self.rejected += 1
+                writer.write(b"HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n")
+                return
+            try:
+                last_event_id = int(headers["last-event-id"])
+            except (KeyError, ValueError):
+                last_event_id = None
+
+            self.streams += 1
+            try:
+                await self.stream(writer, last_event_id)
+            finally:
+                self.streams -= 1
+        except (ConnectionError, asyncio.TimeoutError):
+            pass
+        finally:
+            writer.close()
+
+    async def stream(self, writer, seq):
+        """ Send the events after seq, then every new one, until the client disconnects. Without seq the stream starts
+        at the newest event. """
+        writer.write(LIVE_STREAM_HEADERS + f"retry: {LIVE_STREAM_RETRY_MS}\n\n".encode())
+        while True:
+            new_events = self.new_events  # Taken before reading the buffer, so no event is missed in between
+            newest, events, complete = self.live_feed.events_after(seq)
+            if seq != None:
+                if not complete:
+                    writer.write(b"event: reset\ndata: {}\n\n")  # The dashboard reloads its data instead
+                first = newest - len(events) + 1
+                writer.write(b"".join(format_event(first + i, event) for i, event in enumerate(events)))
+            seq = newest
+
+            try:
+                await asyncio.wait_for(writer.drain(), LIVE_STREAM_WRITE_TIMEOUT_S)
+            except asyncio.TimeoutError:
+                self.timeouts += 1
+                raise
+            try:
+                await asyncio.wait_for(new_events.wait(), LIVE_STREAM_KEEPALIVE_S)
+            except asyncio.TimeoutError:
+                writer.write(b": keepalive\n\n")
+
+    def stats(self):
+        return {"streams": self.streams, "connections": self.connections, "rejected": self.rejected,
+                "timeouts": self.timeouts}
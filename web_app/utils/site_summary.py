@@ -0,0 +1,72 @@
+import datetime
+
+SITE_STALE_AFTER_S = 15 * 60  # Sensors without a reading for this long are counted as stale
+
+
+class LatestValues():
+    """ Latest value per sensor with the running sum, minimum and maximum.
+
+    An update is O(1). Only when the sensor that held the minimum or maximum moves away from it are the values scanned
+    again to find the new one.
+    """
+    def __init__(self):
+        self.values = {}
+        self.total = 0.0
+        self.min_key = None
+        self.max_key = None
+
+    def update(self, key, value):
+        """ Set the value of a key. None removes it. """
+        old = self.values.pop(key, None)
+        if old != None:
+            self.total -= old
+        if value != None:
+            self.values[key] = value
+            self.total += value
+
+        if (key == self.min_key and (value == None or value > old)) or (key == self.max_key and (value == None or value < old)):
+            self.rescan()  # The holder of an extreme moved away from it
+        elif value != None:
+            if self.min_key == None or value < self.values[self.min_key]:
+                self.min_key = key
+            if self.max_key == None or value > self.values[self.max_key]:
+                self.max_key = key
+
+    def rescan(self):
+        self.min_key = min(self.values, key=self.values.get, default=None)
+        self.max_key = max(self.values, key=self.values.get, default=None)
+
+    def summary(self):
+        if not self.values:
+            return {"min": None, "max": None, "avg": None}
+        return {"min": self.values[self.min_key], "max": self.values[self.max_key],
+                "avg": round(self.total / len(self.values), 2)}
+
+
+class SiteSummary():
+    """ Current temperature, humidity and battery statistics of one site, kept up to date by LatestReadings. """
+    def __init__(self, site_id):
+        self.site_id = site_id
+        self.temperature = LatestValues()
+        self.humidity = LatestValues()
+        self.battery_level = LatestValues()
+
+    def update(self, sensor_id, temperature, humidity, battery_level):
+        self.temperature.update(sensor_id, temperature)
+        self.humidity.update(sensor_id, humidity)
+        if battery_level != None:
+            self.battery_level.update(sensor_id, battery_level)
+
+    def to_dict(self, now, last_seen):
+        """ last_seen is the time of the latest reading of every sensor of the site, None if never seen. """
+        stale_before = now - datetime.timedelta(seconds=SITE_STALE_AFTER_S)
+        lowest_battery = self.battery_level.min_key
+        return {
+            "site_id": self.site_id,
+            "sensors": len(last_seen),
+            "stale_sensors": sum(1 for time in last_seen if time == None or time < stale_before),
+            "temperature": self.temperature.summary(),
+            "humidity": self.humidity.summary(),
+            "lowest_battery": None if lowest_battery == None else
+                {"sensor_id": lowest_battery, "battery_level": self.battery_level.values[lowest_battery]},
+        }
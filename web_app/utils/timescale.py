@@ -0,0 +1,242 @@
+import contextlib
+import threading
+import time
+import psycopg2
+import psycopg2.extensions
+from psycopg2.pool import ThreadedConnectionPool
+from config import *
+
+TIMESCALE_CONNECTION = f"postgres://{TIMESCALE_USER}:{TIMESCALE_PASS}@{TIMESCALE_HOST}:{TIMESCALE_PORT}/{TIMESCALE_DATABASE}"
+# Postgres cancels any statement that runs longer than the request timeout, so a slow query cannot hold a connection
+# after its client has given up. An export whose client stops reading is ended once its transaction has been idle too long.
+TIMESCALE_OPTIONS = f"-c statement_timeout={TIMESCALE_STATEMENT_TIMEOUT_MS} -c idle_in_transaction_session_timeout={TIMESCALE_IDLE_TIMEOUT_MS}"
+
+# Continuous aggregates of sensor_data, coarsest first: (bucket width in seconds, view, retention in hours or None).
+# The retention must match the policies in db.sql.
+SENSOR_DATA_RAW_RETENTION_H = 30 * 24
+SENSOR_DATA_AGGREGATES = [
+    (60 * 60, "sensor_data_1h", None),
+    (15 * 60, "sensor_data_15m", 365 * 24),
+    (5 * 60, "sensor_data_5m", 365 * 24),
+    (60, "sensor_data_1m", 30 * 24),
+]
+
+
+class PreparedConnection(psycopg2.extensions.connection):
+    """ Connection that remembers which statements have been prepared on it. """
+    def __init__(self, *args, **kwargs):
+        super().__init__(*args, **kwargs)
+        self.prepared = set()
+
+
+pool = None  # Created on first use, so the reloader's parent process does not connect
+pool_lock = threading.Lock()
+pool_slots = threading.BoundedSemaphore(TIMESCALE_POOL_MAX_CONNECTIONS)  # The pool raises instead of waiting when empty
+query_stats = threading.local()
+
+
+@contextlib.contextmanager
+def pooled_connection():
+    """ Borrow an autocommit connection from the process-wide pool, waiting for one if all are in use.
+    Connections that have been closed, e.g. by a server restart, are discarded instead of returned. """
+    global pool
+    with pool_slots:
+        with pool_lock:
+            if pool == None:
+                pool = ThreadedConnectionPool(TIMESCALE_POOL_MIN_CONNECTIONS, TIMESCALE_POOL_MAX_CONNECTIONS,
+                                              TIMESCALE_CONNECTION, options=TIMESCALE_OPTIONS,
+                                              connection_factory=PreparedConnection)
+        conn = pool.getconn()
+        try:
+            conn.autocommit = True
+            yield conn
+        finally:
+            pool.putconn(conn, close=conn.closed != 0)
+
+def reset_query_stats():
+    """ Start counting the queries of the current thread, e.g. at the start of a request. """
+    query_stats.count = 0
+    query_stats.seconds = 0.0
+
+def get_query_stats():
+    """ Number of queries and the time spent in them since reset_query_stats() in the current thread. """
+    return getattr(query_stats, "count", 0), getattr(query_stats, "seconds", 0.0)
+
+def timescale_read(query, params=None, name=None):
+    """ Run a query on a pooled connection and return all rows.
+    If a name is given, the query is prepared once per connection under that name and executed with EXECUTE, so
+    Postgres does not parse and plan it again. Prepared queries use $1, $2, ... instead of %s for the parameters. """
+    start = time.perf_counter()
+    with pooled_connection() as conn:
+        with conn.cursor() as cursor:
+            if name == None:
+                cursor.execute(query, params)
+            else:
+                if name not in conn.prepared:
+                    cursor.execute(f"PREPARE {name} AS {query}")
+                    conn.prepared.add(name)
+                arguments = f" ({', '.join(['%s'] * len(params))})" if params else ""
+                cursor.execute(f"EXECUTE {name}{arguments}", params)
+            rows = cursor.fetchall()
+
+    query_stats.count = getattr(query_stats, "count", 0) + 1
+    query_stats.seconds = getattr(query_stats, "seconds", 0.0) + time.perf_counter() - start
+    return rows
+
+def get_sensors():
+    """ All sensors as (sensor_id, site_id, sensor_model, location_north, location_east, ble_addr, battery_level, last_seen). """
+    query = """SELECT sensor_id, site_id, sensor_model, location_north, location_east, ble_addr, battery_level, last_seen
+               FROM sensors_latest ORDER BY sensor_id;"""
+    return timescale_read(query, name="sensors_list")
+
+def select_aggregate(interval_h, points):
+    """ Pick the coarsest continuous aggregate that still gives at least the requested number of points.
+    Only tiers that still hold the whole range are considered. Returns None if the raw data should be used. """
+    view = SENSOR_DATA_AGGREGATES[0][1]
+    for bucket_s, candidate, retention_h in SENSOR_DATA_AGGREGATES:
+        if retention_h != None and interval_h > retention_h:
+            break  # The finer tiers are kept even shorter
+        view = candidate
+        if interval_h * 3600 / bucket_s >= points:
+            return view
+
+    if interval_h <= SENSOR_DATA_RAW_RETENTION_H:
+        return None
+    return view
+
+def get_sensor_history(sensor_id, interval_h, points, since=None):
+    """ Readings of one sensor as (time, temperature, humidity), from the coarsest bucket that gives enough points.
+    Falls back to the raw data if even the finest bucket is too coarse for the requested number of points,
+    as long as the range is within the raw retention.
+    If since is given, only the points at or after it are returned. The newest bucket of an aggregate is still
+    filling up, so it is included again and replaces the one the client already has. """
+    view = select_aggregate(interval_h, points)
+    time_column = "time" if view == None else "bucket"
+    since_filter = f"AND {time_column} >= $3" if since != None else ""
+    # One prepared statement per table and filter combination
+    name = f"history_{view or 'raw'}" + ("_since" if since != None else "")
+    key_query = "(SELECT sensor_key FROM sensors WHERE sensor_id = $1)"
+    if view == None:
+        query = f"""SELECT time, temperature, humidity FROM sensor_data
+                    WHERE sensor_key = {key_query} AND time > now() - make_interval(hours => $2) {since_filter} ORDER BY time"""
+    else:
+        query = f"""SELECT bucket, temperature_avg, humidity_avg FROM {view}
+                    WHERE sensor_key = {key_query} AND bucket > now() - make_interval(hours => $2) {since_filter} ORDER BY bucket"""
+    params = (sensor_id, interval_h) if since == None else (sensor_id, interval_h, since)
+    return view, timescale_read(query, params, name=name)
+
+def get_sites():
+    """ All sites as (site_id, site_m2, number_of_sensors). """
+    return timescale_read("SELECT site_id, site_m2, number_of_sensors FROM sites ORDER BY site_id;")
+
+def get_latest_readings():
+    """ Every site with the latest reading and status of each of its sensors as (site_id, sensor_id, sensor_model,
+    location_north, location_east, ble_addr, temperature, humidity, time, battery_level, status time). A site without
+    sensors has one row with a NULL sensor_id, and sensors without readings have NULL values. Each lookup is one index
+    probe per sensor. """
+    query = """SELECT si.site_id, s.sensor_id, s.sensor_model, s.location_north, s.location_east, s.ble_addr,
+                      latest.temperature, latest.humidity, latest.time, status.battery_level, status.time
+               FROM sites si
+               LEFT JOIN sensors s ON s.site_id = si.site_id
+               LEFT JOIN LATERAL (
+                   SELECT time, temperature, humidity FROM sensor_data
+                   WHERE sensor_key = s.sensor_key ORDER BY time DESC LIMIT 1
+               ) latest ON TRUE
+               LEFT JOIN LATERAL (
+                   SELECT time, battery_level FROM sensor_status
+                   WHERE sensor_key = s.sensor_key ORDER BY time DESC LIMIT 1
+               ) status ON TRUE
+               ORDER BY si.site_id, s.sensor_id;"""
+    return timescale_read(query, name="latest_readings")
+
+def get_site_bucket(site_id, view, bucket):
+    """ Averages of every sensor of a site in one bucket of a continuous aggregate as
+    (sensor_id, location_north, location_east, temperature, humidity). """
+    query = f"""SELECT s.sensor_id, s.location_north, s.location_east, a.temperature_avg, a.humidity_avg
+                FROM sensors s JOIN {view} a ON a.sensor_key = s.sensor_key
+                WHERE s.site_id = %s AND a.bucket = %s;"""
+    return timescale_read(query, (site_id, bucket))
+
+# Export: rows are read with a server-side cursor, so neither Postgres nor Flask holds the whole result.
+EXPORT_CHUNK_ROWS = 10000
+SENSOR_DATA_EXPORT_BUCKETS = {"1m": "sensor_data_1m", "5m": "sensor_data_5m", "15m": "sensor_data_15m", "1h": "sensor_data_1h"}
+SENSOR_DATA_EXPORT_COLUMNS = ["time", "sensor_id", "temperature", "humidity"]
+SENSOR_DATA_EXPORT_AGGREGATE_COLUMNS = ["time", "sensor_id", "temperature_avg", "temperature_min", "temperature_max",
+                                        "humidity_avg", "humidity_min", "humidity_max"]
+
+
+def timescale_stream(query, params=None, chunk_rows=EXPORT_CHUNK_ROWS):
+    """ Run a read-only query with a named (server-side) cursor and yield the rows in lists of at most chunk_rows.
+    The connection is closed when the generator is exhausted or closed, e.g. when the client disconnects.
+    Exports use their own connection, as a long download would otherwise hold a pooled one. The request statement
+    timeout is lifted for the transaction, as the fetches of a large export can take longer. """
+    conn = psycopg2.connect(TIMESCALE_CONNECTION, options=TIMESCALE_OPTIONS)
+    try:
+        conn.set_session(readonly=True)
+        with conn.cursor() as cursor:
+            cursor.execute("SET LOCAL statement_timeout = %s", (TIMESCALE_EXPORT_STATEMENT_TIMEOUT_MS,))
+        with conn.cursor(name="export") as cursor:
+            cursor.itersize = chunk_rows
+            cursor.execute(query, params)
+            while True:
+                rows = cursor.fetchmany(chunk_rows)
+                if not rows:
+                    break
+                yield rows
+    finally:
+        conn.close()
+
+def get_export_query(sensor_id=None, site_id=None, bucket=None, start=None, end=None):
+    """ Query for the export of one sensor, or all sensors of a site, as (columns, query, params).
+    bucket is a key of SENSOR_DATA_EXPORT_BUCKETS, or None for the raw readings. start and end are optional datetimes. """
+    if bucket == None:
+        columns = SENSOR_DATA_EXPORT_COLUMNS
+        select = "d.time, s.sensor_id, d.temperature, d.humidity FROM sensor_data d"
+        time_column = "d.time"
+    else:
+        columns = SENSOR_DATA_EXPORT_AGGREGATE_COLUMNS
+        select = f"""d.bucket, s.sensor_id, d.temperature_avg, d.temperature_min, d.temperature_max,
+                     d.humidity_avg, d.humidity_min, d.humidity_max FROM {SENSOR_DATA_EXPORT_BUCKETS[bucket]} d"""
+        time_column = "d.bucket"
+
+    conditions = []
+    params = []
+    if sensor_id != None:
+        conditions.append("s.sensor_id = %s")
+        params.append(sensor_id)
+    if site_id != None:
+        conditions.append("s.site_id = %s")
+        params.append(site_id)
+    if start != None:
+        conditions.append(f"{time_column} >= %s")
+        params.append(start)
+    if end != None:
+        conditions.append(f"{time_column} < %s")
+        params.append(end)
+
+    # Ordering by time only lets TimescaleDB walk the chunks in order instead of sorting the whole range
+    query = f"""SELECT {select} JOIN sensors s ON s.sensor_key = d.sensor_key
+                WHERE {" AND ".join(conditions)} ORDER BY {time_column};"""
+    return columns, query, tuple(params)
+
+def get_overlay_source(bucket_s, interval_h):
+    """ The coarsest table that can be rolled up into buckets of bucket_s seconds and still holds the whole range,
+    as (table, time column, temperature column, humidity column). """
+    for width, view, retention_h in SENSOR_DATA_AGGREGATES:
+        if bucket_s % width == 0 and (retention_h == None or interval_h <= retention_h):
+            return view, "bucket", "temperature_avg", "humidity_avg"
+    return "sensor_data", "time", "temperature", "humidity"
+
+def get_overlay(sensor_ids, site_id, interval_h, bucket_s):
+    """ Readings of several sensors, given by sensor_ids or a site, averaged on one time_bucket grid over the last
+    interval_h hours. Every sensor with data gets a row for every bucket, NULL where it has no data.
+    Returns rows of (bucket, sensor_id, temperature, humidity) ordered by bucket. """
+    table, time_column, temperature, humidity = get_overlay_source(bucket_s, interval_h)
+    sensor_filter = "s.sensor_id = ANY(%s)" if sensor_ids != None else "s.site_id = %s"
+    query = f"""SELECT time_bucket_gapfill(make_interval(secs => %s), d.{time_column},
+                                           now() - make_interval(hours => %s), now()) AS bucket,
+                       s.sensor_id, avg(d.{temperature}), avg(d.{humidity})
+                FROM {table} d JOIN sensors s ON s.sensor_key = d.sensor_key
+                WHERE {sensor_filter} AND d.{time_column} > now() - make_interval(hours => %s) AND d.{time_column} <= now()
+                GROUP BY 1, s.sensor_id ORDER BY 1, s.sensor_id;"""
+    return timescale_read(query, (bucket_s, interval_h, sensor_ids if sensor_ids != None else site_id, interval_h))
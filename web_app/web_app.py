@@ -1,11 +1,53 @@
-from flask import Flask, render_template, jsonify
-from utils.timescale import get_sensors, get_sensor_data
+from flask import Flask, render_template, jsonify, request, Response, stream_with_context, abort, g
+import hashlib
+import logging
+import math
+import time
+import psycopg2.errors
+from waitress import serve
+from utils.timescale import (get_sensor_history, get_sites, get_overlay, select_aggregate, SENSOR_DATA_AGGREGATES,
+                             get_export_query, timescale_stream, SENSOR_DATA_EXPORT_BUCKETS, reset_query_stats, get_query_stats)
+from utils.downsample import downsample_series
+from utils.chart_data import encode_chart_data, CHART_DATA_MIMETYPE
+from utils.export import export_csv, export_parquet, PARQUET_AVAILABLE, CSV_MIMETYPE, PARQUET_MIMETYPE
+from utils.live import LiveFeed
+from utils.live_stream import LiveStreamServer
+from utils.heatmap import HeatmapCache
+from utils.latest import LatestReadings
 import datetime
 from config import *
 
 SENSOR_DATA_INTERVAL_H = 200
+SENSOR_DATA_POINTS = 500  # Default number of points per chart. The data is bucketed to the coarsest aggregate that still gives this many.
+SENSOR_DATA_MAX_POINTS = 1000  # Upper bound of points per chart. Anything above is downsampled with LTTB.
 
 app = Flask(__name__)
+live_feed = LiveFeed(MQTT_HOST, MQTT_PORT, MQTT_TOPIC)
+live_stream = LiveStreamServer(live_feed, WEB_APP_HOST, WEB_APP_STREAM_PORT, WEB_APP_STREAM_CONNECTION_LIMIT)
+latest_readings = LatestReadings()
+heatmap_cache = HeatmapCache(latest_readings)
+live_feed.add_listener(latest_readings.on_reading)
+
+@app.before_request
+def start_request_timer():
+    g.request_start = time.perf_counter()
+    reset_query_stats()
+
+@app.after_request
+def log_request_time(response):
+    """ Log the time of every request and how much of it was spent in queries. Streamed responses are logged before
+    their body is sent. """
+    queries, query_s = get_query_stats()
+    request_s = time.perf_counter() - g.request_start
+    app.logger.info(f"{request.endpoint} {response.status_code} in {request_s * 1000:.1f} ms, "
+                    f"{queries} queries in {query_s * 1000:.1f} ms")
+    return response
+
+@app.errorhandler(psycopg2.errors.QueryCanceled)
+def query_timeout(error):
+    """ The query ran longer than TIMESCALE_STATEMENT_TIMEOUT_MS and was cancelled by Postgres. """
+    app.logger.warning(f"{request.endpoint} query cancelled: {error}")
+    return jsonify({"error": "Query timed out"}), 503
 
 @app.route("/")
 def home():
@@ -13,29 +55,184 @@ def home():
 
 @app.route("/sites/")
 def sites():
-    """ Show view of the different sites. Currently not used. """
-    return render_template("sites.html")
+    """ Show view of the different sites, with a heatmap of each. """
+    live_feed.start()
+    site_list = get_sites()
+    return render_template("sites.html", site_list=site_list)
+
+@app.route("/sites/summary", methods=['GET'])
+def site_summary():
+    """ Current min/max/avg temperature and humidity, stale sensor count and lowest battery of every site.
+    Served from memory, kept up to date by the live feed. """
+    live_feed.start()
+    ret_json = jsonify(latest_readings.site_summaries())
+    ret_json.cache_control.no_cache = True
+    return ret_json
+
+@app.route("/sites/<string:site_id>/heatmap", methods=['GET'])
+def site_heatmap(site_id):
+    """ Temperature and humidity of a site interpolated over a grid of its sensor locations.
+    Without parameters the latest readings are used. The grid is only recomputed after a new reading has arrived.
+    With at (epoch ms) the 15 minute averages of the bucket containing that time are used instead. """
+    at = request.args.get("at", type=int)
+    if at == None:
+        live_feed.start()
+        heatmap = heatmap_cache.get_latest(site_id)
+    else:
+        heatmap = heatmap_cache.get_at(site_id, datetime.datetime.fromtimestamp(at / 1000, tz=datetime.timezone.utc))
+    if heatmap == None:
+        abort(404)
+
+    ret_json = jsonify(heatmap)
+    ret_json.set_etag(hashlib.sha1(repr((site_id, heatmap["timestamp"], heatmap["sensors"])).encode()).hexdigest())
+    ret_json.cache_control.no_cache = True
+    return ret_json.make_conditional(request)
 
 @app.route("/sensors/")
 def sensors():
-    sensor_list = get_sensors()
-    return render_template("sensors.html", sensor_list=sensor_list)
+    """ Table of the sensors. Served from memory, kept up to date by the live feed. """
+    live_feed.start()
+    live_stream.start()
+    sensor_list = latest_readings.sensor_list()
+    return render_template("sensors.html", sensor_list=sensor_list, stream_port=WEB_APP_STREAM_PORT)
+
+@app.route("/stats")
+def stats():
+    """ Counters of the in-process caches, the live feed and the live streams. """
+    return jsonify({
+        "latest_readings": latest_readings.stats(),
+        "heatmap_computations": heatmap_cache.computations,
+        "live_feed": {"events": live_feed.seq, "buffered": len(live_feed.events)},
+        "live_stream": live_stream.stats(),
+    })
 
 @app.route('/sensors/<string:sensor_id>', methods=['GET'])
 def sensor_data(sensor_id):
-    """ Fetch the sensor data from the database. Called when a sensor is clicked in the table. """
-    sensor_data_list = get_sensor_data(str(sensor_id), int(SENSOR_DATA_INTERVAL_H)) 
+    """ Fetch the sensor data from the database. Called when a sensor is clicked in the table. 
+    Optional query parameters: hours (range to show), points (wanted number of points), max_points (upper bound),
+    and since (epoch ms) to only get the points from that time on. Unchanged responses are answered with 304.
+    With format=binary the points are sent as typed columns (see utils/chart_data.py) and the bucket as a header. """
+    interval_h = request.args.get("hours", SENSOR_DATA_INTERVAL_H, type=int)
+    points = request.args.get("points", SENSOR_DATA_POINTS, type=int)
+    max_points = request.args.get("max_points", SENSOR_DATA_MAX_POINTS, type=int)
+    since = request.args.get("since", type=int)
+    if since != None:
+        since = datetime.datetime.fromtimestamp(since / 1000, tz=datetime.timezone.utc)
+    bucket, sensor_data_list = get_sensor_history(str(sensor_id), interval_h, min(points, max_points), since) 
     timestamps = [measurement[0] for measurement in sensor_data_list]
-    temp_measurements = [measurement[2] for measurement in sensor_data_list]
-    hum_measurements = [measurement[3] for measurement in sensor_data_list]
+    temp_measurements = [measurement[1] for measurement in sensor_data_list]
+    hum_measurements = [measurement[2] for measurement in sensor_data_list]
+
+    # Bound the payload and the render time regardless of the range
+    kept = downsample_series(timestamps, [temp_measurements, hum_measurements], max_points)
+    if len(kept) < len(timestamps):
+        timestamps = [timestamps[i] for i in kept]
+        temp_measurements = [temp_measurements[i] for i in kept]
+        hum_measurements = [hum_measurements[i] for i in kept]
 
-    ret_json = jsonify( {
+    if request.args.get("format") == "binary":
+        ret_json = Response(encode_chart_data(timestamps, temp_measurements, hum_measurements), mimetype=CHART_DATA_MIMETYPE)
+        ret_json.headers["X-Chart-Bucket"] = bucket or ""
+    else:
+        ret_json = jsonify( {
+            "bucket": bucket,
+            "timestamps": timestamps,
+            "temp_measurements": temp_measurements,
+            "hum_measurements": hum_measurements
+        })
+
+    # The newest point identifies the response, as the range only grows at the end
+    etag = hashlib.sha1(repr((request.full_path, bucket, len(timestamps), timestamps[-1:], temp_measurements[-1:], hum_measurements[-1:])).encode()).hexdigest()
+    ret_json.set_etag(etag)
+    if timestamps:
+        ret_json.last_modified = timestamps[-1]
+    ret_json.cache_control.no_cache = True
+    return ret_json.make_conditional(request)
+
+@app.route('/overlay', methods=['GET'])
+def overlay():
+    """ Several sensors on one time grid, from one query. Query parameters: sensor_ids (comma separated) or site_id,
+    and optionally hours (range to show) and bucket_s (bucket width in seconds). By default the width of the coarsest
+    aggregate that still gives SENSOR_DATA_POINTS points is used, widened if needed to stay within
+    SENSOR_DATA_MAX_POINTS. Buckets without data are null. """
+    sensor_ids = request.args.get("sensor_ids")
+    site_id = request.args.get("site_id")
+    if (sensor_ids == None) == (site_id == None):
+        abort(400, "Give either sensor_ids or site_id")
+    if sensor_ids != None:
+        sensor_ids = sensor_ids.split(",")
+    interval_h = request.args.get("hours", SENSOR_DATA_INTERVAL_H, type=int)
+    default_view = select_aggregate(interval_h, SENSOR_DATA_POINTS)
+    default_bucket_s = next((width for width, view, _ in SENSOR_DATA_AGGREGATES if view == default_view), 60)
+    # Long ranges need wider buckets to stay within SENSOR_DATA_MAX_POINTS: the narrowest aggregate that is wide enough,
+    # or whole hours beyond the coarsest one
+    min_bucket_s = math.ceil(interval_h * 3600 / SENSOR_DATA_MAX_POINTS)
+    if default_bucket_s < min_bucket_s:
+        default_bucket_s = next((width for width, _, _ in reversed(SENSOR_DATA_AGGREGATES) if width >= min_bucket_s),
+                                math.ceil(min_bucket_s / 3600) * 3600)
+    bucket_s = request.args.get("bucket_s", default_bucket_s, type=int)
+    if bucket_s <= 0 or interval_h * 3600 / bucket_s > SENSOR_DATA_MAX_POINTS:
+        abort(400, f"At most {SENSOR_DATA_MAX_POINTS} buckets per series")
+
+    timestamps = []
+    series = {}
+    for bucket, sensor_id, temperature, humidity in get_overlay(sensor_ids, site_id, interval_h, bucket_s):
+        if not timestamps or timestamps[-1] != bucket:
+            timestamps.append(bucket)
+        if sensor_id not in series:
+            series[sensor_id] = {"sensor_id": sensor_id, "temp_measurements": [], "hum_measurements": []}
+        series[sensor_id]["temp_measurements"].append(temperature)
+        series[sensor_id]["hum_measurements"].append(humidity)
+
+    ret_json = jsonify({
+        "bucket_s": bucket_s,
         "timestamps": timestamps,
-        "temp_measurements": temp_measurements,
-        "hum_measurements": hum_measurements
+        "series": [series[sensor_id] for sensor_id in sorted(series)]
     })
-
+    ret_json.cache_control.no_cache = True
     return ret_json
 
+@app.route('/sensors/<string:sensor_id>/export', methods=['GET'])
+def sensor_export(sensor_id):
+    """ Download the history of one sensor. See export_response() for the query parameters. """
+    return export_response(sensor_id, sensor_id=sensor_id)
+
+@app.route('/sites/<string:site_id>/export', methods=['GET'])
+def site_export(site_id):
+    """ Download the history of every sensor of a site. See export_response() for the query parameters. """
+    return export_response(site_id, site_id=site_id)
+
+def export_response(name, sensor_id=None, site_id=None):
+    """ Stream an export in chunks from a server-side cursor, so any range is sent in constant memory.
+    Optional query parameters: format (csv or parquet), bucket (1m, 5m, 15m or 1h, raw readings if not given),
+    and start and end (epoch ms). """
+    export_format = request.args.get("format", "csv")
+    bucket = request.args.get("bucket")
+    if export_format not in ("csv", "parquet"):
+        abort(400, f"Unknown format {export_format}")
+    if export_format == "parquet" and not PARQUET_AVAILABLE:
+        abort(400, "Parquet export needs pyarrow")
+    if bucket != None and bucket not in SENSOR_DATA_EXPORT_BUCKETS:
+        abort(400, f"Unknown bucket {bucket}")
+    start, end = [request.args.get(arg, type=int) for arg in ("start", "end")]
+    start, end = [None if ms == None else datetime.datetime.fromtimestamp(ms / 1000, tz=datetime.timezone.utc) for ms in (start, end)]
+
+    columns, query, params = get_export_query(sensor_id, site_id, bucket, start, end)
+    chunks = timescale_stream(query, params)
+    if export_format == "parquet":
+        response = Response(stream_with_context(export_parquet(chunks, columns)), mimetype=PARQUET_MIMETYPE)
+    else:
+        response = Response(stream_with_context(export_csv(chunks, columns)), mimetype=CSV_MIMETYPE)
+    response.headers["Content-Disposition"] = f'attachment; filename="{name}_{bucket or "raw"}.{export_format}"'
+    response.headers["X-Accel-Buffering"] = "no"
+    return response
+
 if __name__ == "__main__":
-    app.run(debug=True, host=WEB_APP_HOST, port=WEB_APP_PORT)
+    if WEB_APP_DEBUG:
+        app.run(debug=True, host=WEB_APP_HOST, port=WEB_APP_PORT)
+    else:
+        logging.basicConfig(level=logging.INFO, format="%(asctime)s %(levelname)s %(name)s: %(message)s")
+        live_stream.start()  # Open dashboards reconnect to it after a restart, before any page is loaded
+        # Threaded production server. Requests beyond the worker threads are queued, not given a thread each.
+        serve(app, host=WEB_APP_HOST, port=WEB_APP_PORT, threads=WEB_APP_THREADS,
+              connection_limit=WEB_APP_CONNECTION_LIMIT, channel_timeout=WEB_APP_CHANNEL_TIMEOUT_S)